@@ -0,0 +1,150 @@
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <map>
+#include <mutex>
+#include <stdlib.h>
+#include <vector>
+
+#include "Exception.h"
+
+using namespace std;
+
+// alignment in bytes of pooled buffers, and the size class granularity
+const size_t POOL_ALIGN = 64;
+
+// default limit on the bytes of released buffers kept for reuse
+const size_t POOL_CACHE_LIMIT = (size_t)512 << 20;
+
+/* Buffer counters of a BufferPool. */
+struct PoolStats_t {
+  long heapAllocs;    // buffers allocated from the heap
+  long heapFrees;     // buffers returned to the heap
+  long reuses;        // requests served by a released buffer
+  size_t liveBytes;   // bytes of the buffers in use
+  size_t cachedBytes; // bytes of the released buffers kept for reuse
+
+  PoolStats_t()
+      : heapAllocs(0), heapFrees(0), reuses(0), liveBytes(0),
+        cachedBytes(0) {}
+};
+
+/* Size classed pool of the pixel buffers of Image<T>.  Sizes are rounded up
+   to a multiple of POOL_ALIGN bytes and a released buffer is kept on the
+   free list of its size class, so the next image of that size takes it
+   instead of the heap.  A video pipeline allocates the same few frame sizes
+   over and over, so after the first frames every image is served from the
+   free lists.  Released buffers beyond the cache limit go back to the heap.
+   The pool is shared by all threads. */
+class BufferPool {
+private:
+  mutex poolMutex;                        // guards everything below
+  map<size_t, vector<void *> > freeLists; // released buffers by size
+  size_t limit;                           // most bytes kept in freeLists
+  PoolStats_t counts;                     // buffer counters
+
+  BufferPool() : limit(POOL_CACHE_LIMIT) {}
+
+  static size_t sizeClass(const size_t bytes) {
+    return ((bytes + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN);
+  }
+
+  // free cached buffers, largest first, until at most bytes are cached
+  void shrink(const size_t bytes) {
+    map<size_t, vector<void *> >::reverse_iterator it;
+    for (it = freeLists.rbegin();
+         it != freeLists.rend() && counts.cachedBytes > bytes; ++it) {
+      vector<void *> &list = it->second;
+      while (!list.empty() && counts.cachedBytes > bytes) {
+        free(list.back());
+        list.pop_back();
+        counts.cachedBytes -= it->first;
+        counts.heapFrees++;
+      }
+    }
+  }
+
+public:
+  // not copyable
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // pool shared by all images; never destroyed, so images released during
+  // static destruction still find it
+  static BufferPool &instance() {
+    static BufferPool *pool = new BufferPool();
+    return (*pool);
+  }
+
+  /* A buffer of at least bytes bytes aligned to POOL_ALIGN, or null for
+     zero bytes.  The contents are not initialized. */
+  void *acquire(const size_t bytes) {
+    if (bytes == 0)
+      return (0);
+
+    size_t n = sizeClass(bytes);
+    lock_guard<mutex> lock(poolMutex);
+
+    counts.liveBytes += n;
+
+    map<size_t, vector<void *> >::iterator it = freeLists.find(n);
+    if (it != freeLists.end() && !it->second.empty()) {
+      void *p = it->second.back();
+      it->second.pop_back();
+      counts.cachedBytes -= n;
+      counts.reuses++;
+      return (p);
+    }
+
+    void *p = 0;
+    if (posix_memalign(&p, POOL_ALIGN, n) != 0) {
+      counts.liveBytes -= n;
+      throw Exception("unable to allocate image buffer");
+    }
+    counts.heapAllocs++;
+
+    return (p);
+  }
+
+  // return a buffer from acquire(bytes) to its size class
+  void release(void *p, const size_t bytes) {
+    if (!p)
+      return;
+
+    size_t n = sizeClass(bytes);
+    lock_guard<mutex> lock(poolMutex);
+
+    counts.liveBytes -= n;
+    freeLists[n].push_back(p);
+    counts.cachedBytes += n;
+
+    if (counts.cachedBytes > limit)
+      shrink(limit);
+  }
+
+  // return every cached buffer to the heap
+  void trim() {
+    lock_guard<mutex> lock(poolMutex);
+    shrink(0);
+  }
+
+  // most bytes of released buffers kept for reuse (0 disables the cache)
+  void setCacheLimit(const size_t bytes) {
+    lock_guard<mutex> lock(poolMutex);
+    limit = bytes;
+    shrink(limit);
+  }
+
+  PoolStats_t stats() {
+    lock_guard<mutex> lock(poolMutex);
+    return (counts);
+  }
+
+  // zero the allocation counters, the byte totals are kept
+  void resetCounters() {
+    lock_guard<mutex> lock(poolMutex);
+    counts.heapAllocs = counts.heapFrees = counts.reuses = 0;
+  }
+};
+
+#endif // _BUFFERPOOL_H_
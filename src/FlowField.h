@@ -0,0 +1,84 @@
+#ifndef _FLOWFIELD_H_
+#define _FLOWFIELD_H_
+
+#include <fstream>
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "Exception.h"
+#include "Image.h"
+
+using namespace std;
+
+/* Dense optical flow field stored as two planes, the horizontal (u) and
+   vertical (v) displacement of every pixel.  The flow engines read and write
+   the planes directly, so a component is passed on as an Image<float>
+   without a copy, and a pixel is read as a Vec2f_t from both planes.  The
+   field is copyable and movable like Image<T>.
+
+   Every engine uses the same sign: the flow (u, v) of pixel x is where the
+   content of pImg at x moved to in cImg, cImg(x + (u, v)) = pImg(x), so a
+   scene panning right and down has positive u and v, and the writers draw
+   each vector along the motion. */
+class FlowField {
+private:
+  Image<float> _u, _v; // horizontal and vertical displacement
+
+public:
+  FlowField() {}
+
+  FlowField(const int h, const int w) : _u(h, w), _v(h, w) {}
+
+  // allocate h x w planes of zero flow
+  void init(const int h, const int w) {
+    _u.init(h, w);
+    _v.init(h, w);
+  }
+
+  int height() const { return (_u.height()); }
+
+  int width() const { return (_u.width()); }
+
+  // true if both planes are h x w
+  bool hasSize(const int h, const int w) const {
+    return (_u.height() == h && _u.width() == w && _v.height() == h &&
+            _v.width() == w);
+  }
+
+  // component planes, views into the field
+  Image<float> &u() { return (_u); }
+
+  const Image<float> &u() const { return (_u); }
+
+  Image<float> &v() { return (_v); }
+
+  const Image<float> &v() const { return (_v); }
+
+  // flow vector of pixel ind
+  Vec2f_t operator[](const int ind) const {
+    Vec2f_t vp;
+    vp[0] = _u[ind];
+    vp[1] = _v[ind];
+    return (vp);
+  }
+
+  void setPixel(const int ind, const Vec2f_t &vp) {
+    _u[ind] = vp[0];
+    _v[ind] = vp[1];
+  }
+
+  void swap(FlowField &f) {
+    std::swap(_u, f._u);
+    std::swap(_v, f._v);
+  }
+
+  void writeToFile(const string &fname) const;
+
+  void writeToFile(const string &fname, const float *textimg) const;
+};
+
+#include "FlowField.inl"
+
+#endif // _FLOWFIELD_H_
@@ -0,0 +1,159 @@
+/* Write the flow as a P5 plot of the vectors on a 10 pixel grid. */
+void FlowField::writeToFile(const string &fname) const {
+  ofstream ofile;
+  int height = _u.height();
+  int width = _u.width();
+  int spac = 10;
+
+  // allocate space
+  unsigned char *img = new unsigned char[height * width];
+  memset(img, 0, height * width * sizeof(unsigned char));
+
+  // construct the graphical vector field
+  for (int h = 0; h < height; h += spac) {
+    for (int w = 0; w < width; w += spac) {
+      int ex = w + _u[h * width + w];
+      int ey = h + _v[h * width + w];
+
+      if (ex >= 0 && ex < width && ey >= 0 && ey < height) {
+        drawLine(w, h, ex, ey, (unsigned char)255, height, width, img);
+      }
+    }
+  }
+
+  // open file and check
+  ofile.open(fname.c_str());
+  if (!ofile) {
+    throw(Exception("unable to open file for writing"));
+  }
+
+  // write to file
+  ofile << "P5" << endl << width << " " << height << endl << "255" << endl;
+  ofile.write((char *)img, width * height * sizeof(unsigned char));
+  ofile.close();
+
+  delete[] img;
+}
+
+/* Write the flow as a P6 image of the texture textimg smeared along the
+   flow direction and weighted by the flow magnitude. */
+void FlowField::writeToFile(const string &fname, const float *textimg) const {
+  ofstream ofile;
+  vector<int> p_x, p_y;
+  int p0_x, p0_y, p1_x, p1_y;
+  int height = _u.height();
+  int width = _u.width();
+  float dist = 5.0;
+
+  // allocate space
+  float *accimg = new float[height * width];
+  memset(accimg, 0, height * width * sizeof(float));
+
+  // allocate space for magnitudes
+  float *magimg = new float[height * width];
+  memset(magimg, 0, height * width * sizeof(float));
+
+  // integrate vectors
+  float v, mag, sqrt_2 = sqrt(2.0);
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      float fu = _u[h * width + w];
+      float fv = _v[h * width + w];
+      mag = sqrt(fu * fu + fv * fv);
+
+      // remove vectors less than one 8-connected pixel
+      if (mag < sqrt_2)
+        continue;
+
+      magimg[h * width + w] = mag;
+
+      p0_x = int(w + fu / mag * dist + 0.5);
+      p0_y = int(h + fv / mag * dist + 0.5);
+      p1_x = int(w - fu / mag * dist + 0.5);
+      p1_y = int(h - fv / mag * dist + 0.5);
+
+      getLinePts(p0_x, p0_y, p1_x, p1_y, p_x, p_y);
+
+      v = 0;
+      for (unsigned i = 0; i < p_x.size(); i++) {
+        int hp = p_y[i];
+        int wp = p_x[i];
+
+        if (hp >= 0 && hp < height && wp >= 0 && wp < width) {
+          v += textimg[hp * width + wp];
+        }
+      }
+
+      accimg[h * width + w] = v;
+    }
+  }
+
+  // convolve vector directions with strength
+  for (int i = 0; i < width * height; i++) {
+    accimg[i] *= magimg[i];
+  }
+
+  // get stats
+  float min = accimg[0];
+  float max = accimg[0];
+  for (int i = 0; i < width * height; i++) {
+    if (min > accimg[i])
+      min = accimg[i];
+    if (max < accimg[i])
+      max = accimg[i];
+  }
+
+  // open file and check
+  ofile.open(fname.c_str());
+  if (!ofile) {
+    throw(Exception("unable to open file for writing"));
+  }
+
+  ofile << "P6\n" << width << " " << height << "\n255\n";
+
+  // scale factor
+  float scale = 1.0;
+  if (max - min > 0.01)
+    scale = 255.0 / (max - min);
+
+  // write to file
+  for (int i = 0; i < width * height; i++) {
+    unsigned char val;
+    val = scale * (accimg[i] - min) + 0.5;
+    ofile.write((char *)&jetBlackMap[val][0], sizeof(unsigned char));
+    ofile.write((char *)&jetBlackMap[val][1], sizeof(unsigned char));
+    ofile.write((char *)&jetBlackMap[val][2], sizeof(unsigned char));
+  }
+
+  ofile.close();
+
+  delete[] accimg;
+  delete[] magimg;
+}
+
+// compute magnitude and direction channels
+Image<float> *getMagnitude(const FlowField *flow) {
+  Image<float> *rtn = new Image<float>(flow->height(), flow->width());
+  int numElems = flow->height() * flow->width();
+
+  for (int i = 0; i < numElems; i++) {
+    float v = flow->u()[i] * flow->u()[i] + flow->v()[i] * flow->v()[i];
+
+    rtn->setPixel(i, sqrt(v));
+  }
+
+  return (rtn);
+}
+
+// compute magnitude and direction channels
+Image<float> *getDirection(const FlowField *flow) {
+  Image<float> *rtn = new Image<float>(flow->height(), flow->width());
+  int numElems = flow->height() * flow->width();
+
+  for (int i = 0; i < numElems; i++) {
+    float v = atan2(flow->v()[i], flow->u()[i]);
+    rtn->setPixel(i, v);
+  }
+
+  return (rtn);
+}
@@ -0,0 +1,88 @@
+#ifndef _FLOWSTREAM_H_
+#define _FLOWSTREAM_H_
+
+#include "FlowField.h"
+#include "Image.h"
+#include "opticalFlow.h"
+
+/* Hierarchical Lucas and Kanade optical flow over a stream of frames.  Every
+   frame is the current image of one pair and the previous image of the
+   next, so the gaussian pyramid and derivatives of each frame are built
+   once, when it is added, and kept for the following pair.  With
+   params.warmStart the flow of each pair seeds the estimate of the next, and
+   with params.motionGate only the tiles that changed between the frames are
+   solved.  The working buffers are kept from one pair to the next, so once
+   the first pairs have been solved a stream of frames of the same size
+   allocates no memory. */
+class FlowStream {
+private:
+  FramePyramid_t prev, curr;     // pyramids of the last two frames
+  bool havePrev;                 // prev holds a frame
+  int winSize;                   // LK window size
+  FlowParams_t params;           // estimator options
+  FlowField flowPrev;            // flow of the last pair
+  bool haveFlow;                 // flowPrev holds a flow
+  TileMask_t tiles;              // active tiles of the last pair
+  FlowStats_t stats;             // statistics of the last pair
+  HLKLevels_t scratch;           // per-level buffers kept between pairs
+  vector<unsigned char> changed; // changed tiles of the last pair
+
+public:
+  FlowStream(const int w, const FlowParams_t &p = FlowParams_t())
+      : havePrev(false), winSize(w), params(p), haveFlow(false) {}
+
+  // forget the previous frame and flow, e.g. at a cut
+  void reset() { havePrev = haveFlow = false; }
+
+  /* Add the next frame.  Returns false for the first frame of the stream,
+     otherwise computes the optical flow from the previous frame to this one
+     and returns true. */
+  bool addFrame(const Image<float> *img, FlowField *flow) {
+    buildFramePyramid(img, pyramidLevels(params, img->height(), img->width()),
+                      &curr);
+
+    bool computed = havePrev;
+    if (computed) {
+      if (img->height() != prev.levels[0].height() ||
+          img->width() != prev.levels[0].width()) {
+        throw Exception("frame dimensions changed within a flow stream");
+      }
+
+      // change detection on the finest levels
+      if (params.motionGate) {
+        detectMotionTiles(&prev.levels[0], &curr.levels[0],
+                          params.motionThreshold, params.motionTileSize,
+                          &tiles, &changed);
+      } else {
+        tiles.init(img->height(), img->width(), params.motionTileSize);
+      }
+
+      bool seed = params.warmStart && haveFlow;
+      computeOpticalFlow_HLK(&prev, &curr, seed ? &flowPrev.u() : 0,
+                             seed ? &flowPrev.v() : 0, winSize, &flow->u(),
+                             &flow->v(), params,
+                             params.motionGate ? &tiles : 0, &stats,
+                             &scratch);
+
+      if (params.warmStart) {
+        flowPrev = *flow;
+        haveFlow = true;
+      }
+    }
+
+    // the current frame is the previous frame of the next pair
+    prev.levels.swap(curr.levels);
+    prev.derivs.swap(curr.derivs);
+    havePrev = true;
+
+    return (computed);
+  }
+
+  // tiles of the last frame pair that were solved (all without motionGate)
+  const TileMask_t &motionTiles() const { return (tiles); }
+
+  // skipped and ill conditioned pixels per level of the last frame pair
+  const FlowStats_t &flowStats() const { return (stats); }
+};
+
+#endif // _FLOWSTREAM_H_
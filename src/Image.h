@@ -4,15 +4,31 @@
 #include <fstream>
 #include <math.h>
 #include <string.h>
+#include <type_traits>
 #include <vector>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 using namespace std;
 
+#include "BufferPool.h"
 #include "Exception.h"
+#include "ThreadPool.h"
 #include "cmap.h"
 #include "drawLine.h"
 #include "getLinePts.h"
 
+// number of output rows per thread in the separable convolve()
+const int CONV_BAND_ROWS = 32;
+
+// kernel taps up to which the separable filters keep their row pointers on
+// the stack
+const int CONV_STACK_TAPS = 64;
+
 /* Abstraction of a 2-D vector used as an image pixel type below. */
 struct Vec2f_t {
   float v[2];
@@ -20,8 +36,10 @@ struct Vec2f_t {
   // initialize to zero
   Vec2f_t() { v[0] = v[1] = 0.0; }
 
-  // accessor
+  // accessors
   float &operator[](const int i) { return (v[i]); }
+
+  const float &operator[](const int i) const { return (v[i]); }
 };
 
 /* Abstraction of a RGB color vector used as an image pixel type below. */
@@ -35,12 +53,37 @@ struct RGB_t {
   unsigned char &operator[](const int i) { return (c[i]); }
 };
 
-/* Abstraction of a 2-D image with template pixel type. */
-template <typename T> class Image {
+/* Base of the lazy element-wise image expressions below.  E is the
+   expression type, which provides value_type, height(), width() and
+   eval(i), the value of pixel i. */
+template <typename E> struct ImageExpr {
+  const E &self() const { return (static_cast<const E &>(*this)); }
+};
+
+/* Abstraction of a 2-D image with template pixel type.  Pixel storage comes
+   from the shared BufferPool and T must be a plain type.  Resizing an image
+   to the number of pixels it already holds reuses its storage. */
+template <typename T> class Image : public ImageExpr<Image<T> > {
 private:
   T *_data;            // dynamic data storage for 2-D array of pixel
   int _height, _width; // image dimensions
 
+  // evaluate expression x of the same dimensions into this image
+  template <typename E> void assign(const E &x);
+
+  // h x w pixels of uninitialized storage, kept if the pixel count matches
+  void allocate(const int h, const int w) {
+    if (!_data || h * w != _height * _width) {
+      clear();
+      _data = (T *)BufferPool::instance().acquire((size_t)h * w * sizeof(T));
+    }
+    _height = h;
+    _width = w;
+  }
+
+  template <int KH, int KW>
+  void convolve2D(const float *k, const int kheight, const int kwidth);
+
 public:
   Image() : _data(0), _height(0), _width(0) {}
 
@@ -48,27 +91,29 @@ public:
     init(_height, _width);
   }
 
-  Image(const Image<T> &o) : _data(0), _height(o._height), _width(o._width) {
-    init(_height, _width);
+  Image(const Image<T> &o) : _data(0), _height(0), _width(0) {
+    allocate(o._height, o._width);
     memcpy(_data, o._data, _height * _width * sizeof(T));
   }
 
+  Image(Image<T> &&o) noexcept
+      : _data(o._data), _height(o._height), _width(o._width) {
+    o._data = 0;
+    o._height = o._width = 0;
+  }
+
+  // evaluate an element-wise expression of pixel type T in one pass
+  template <typename E> Image(const ImageExpr<E> &e);
+
   ~Image() { clear(); }
 
   void init(const int h, const int w) {
-    if (_data) {
-      clear();
-    }
-
-    _height = h;
-    _width = w;
-    _data = new T[_height * _width]; // row major
+    allocate(h, w); // row major
     memset(_data, 0, _height * _width * sizeof(T));
   }
 
   void clear() {
-    if (_data)
-      delete[] _data;
+    BufferPool::instance().release(_data, (size_t)_height * _width * sizeof(T));
     _height = _width = 0;
     _data = 0;
   }
@@ -79,25 +124,56 @@ public:
 
   Image<T> &operator=(const Image<T> &rhs) {
     if (this != &rhs) {
+      allocate(rhs._height, rhs._width);
+      memcpy(_data, rhs._data, _height * _width * sizeof(T));
+    }
+
+    return (*this);
+  }
+
+  Image<T> &operator=(Image<T> &&rhs) noexcept {
+    if (this != &rhs) {
+      clear();
+      _data = rhs._data;
       _height = rhs._height;
       _width = rhs._width;
-      init(_height, _width);
-      memcpy(_data, rhs._data, _height * _width * sizeof(T));
+      rhs._data = 0;
+      rhs._height = rhs._width = 0;
     }
 
     return (*this);
   }
 
+  template <typename E> Image<T> &operator=(const ImageExpr<E> &e);
+
+  // expression interface
+  typedef T value_type;
+
+  const T &eval(const int i) const { return (_data[i]); }
+
   T &operator[](const int &i) const { return (_data[i]); }
 
   T &getPixel(const int ind) const { return (_data[ind]); }
 
   void setPixel(const int ind, const T &val) { _data[ind] = val; }
 
+  void fill(const T &val) {
+    for (int i = 0; i < _height * _width; i++) {
+      _data[i] = val;
+    }
+  }
+
   void convolve(const float *k, const int ksize);
 
   void convolve(const float *k, const int kheight, const int kwidth);
 
+  // convolve with a KH x KW kernel whose size is known at compile time
+  template <int KH, int KW> void convolve(const float *k) {
+    convolve2D<KH, KW>(k, KH, KW);
+  }
+
+  void decimate2(const float *k, const int ksize, Image<T> *dst) const;
+
   void pyramid(const int levels, vector<Image<T> > &py) const;
 
   Image<T> upsample2() const;
@@ -106,19 +182,85 @@ public:
 
   T bilinear(const float h, const float w) const;
 
-  Image<T> operator+(const Image<T> &im) const;
+  void readFromFile(const string &fname);
 
-  Image<T> operator-(const Image<T> &im) const;
+  void writeToFile(const string &fname) const;
+};
 
-  Image<T> operator*(const Image<T> &im) const;
+/* How an expression holds an operand of type E.  Sub-expressions are small
+   and often temporaries, so they are copied; images are referenced. */
+template <typename E> struct ImageOperand_t {
+  typedef const E type;
+};
 
-  Image<T> operator*(const T &val) const;
+template <typename T> struct ImageOperand_t<Image<T> > {
+  typedef const Image<T> &type;
+};
 
-  void readFromFile(const string &fname);
+/* Element-wise binary operation Op of two image expressions of the same
+   dimensions.  Expressions reference the images they read and copy their
+   sub-expressions, so an expression stays valid as long as its images do.
+   Assigning it to an image evaluates the whole chain in one loop without
+   temporary images. */
+template <typename L, typename R, typename Op>
+class ImageBinaryExpr : public ImageExpr<ImageBinaryExpr<L, R, Op> > {
+private:
+  typename ImageOperand_t<L>::type _l;
+  typename ImageOperand_t<R>::type _r;
 
-  void writeToFile(const string &fname) const;
+public:
+  typedef typename L::value_type value_type;
 
-  void writeToFile(const string &fname, const float *textimg) const;
+  ImageBinaryExpr(const L &l, const R &r) : _l(l), _r(r) {
+    if (l.height() != r.height() || l.width() != r.width())
+      throw Exception("image dimensions do not match");
+  }
+
+  int height() const { return (_l.height()); }
+
+  int width() const { return (_l.width()); }
+
+  value_type eval(const int i) const {
+    return (Op::apply(_l.eval(i), _r.eval(i)));
+  }
+};
+
+/* Element-wise product of an image expression and a scalar. */
+template <typename E>
+class ImageScaleExpr : public ImageExpr<ImageScaleExpr<E> > {
+private:
+  typename ImageOperand_t<E>::type _e;
+  typename E::value_type _val;
+
+public:
+  typedef typename E::value_type value_type;
+
+  ImageScaleExpr(const E &e, const value_type &val) : _e(e), _val(val) {}
+
+  int height() const { return (_e.height()); }
+
+  int width() const { return (_e.width()); }
+
+  value_type eval(const int i) const { return (_e.eval(i) * _val); }
+};
+
+// element-wise operations of the binary expressions
+struct ImageAdd_t {
+  template <typename T> static T apply(const T &a, const T &b) {
+    return (a + b);
+  }
+};
+
+struct ImageSub_t {
+  template <typename T> static T apply(const T &a, const T &b) {
+    return (a - b);
+  }
+};
+
+struct ImageMul_t {
+  template <typename T> static T apply(const T &a, const T &b) {
+    return (a * b);
+  }
 };
 
 #include "Image.inl"
@@ -1,67 +1,285 @@
+/* 1-D convolution of one row of width samples with the 2 * center + 1
+   taps of k, where samples outside the row are skipped (zero). */
+template <typename S>
+void convolveRow(const S *src, const int width, const float *k,
+                 const int center, float *dst) {
+  for (int w = 0; w < width; w++) {
+    float d = 0.0;
+    for (int c = -center; c <= center; c++) {
+      int wp = w + c;
+      if (wp >= 0 && wp < width)
+        d += src[wp] * k[center + c];
+    }
+    dst[w] = d;
+  }
+}
+
+/* Vectorized convolveRow() for float rows.  Only the first and last center
+   columns have taps outside the row, the columns between them take every
+   tap in the same order, so the sums are the same as the scalar loop.  N is
+   the number of taps known at compile time, so the tap loops unroll, or 0
+   to take it from center. */
+template <int N>
+void convolveRowTaps(const float *src, const int width, const float *k,
+                     const int center, float *dst) {
+  const int n = N ? N : 2 * center + 1;
+  int w0 = min(center, width);
+  int w1 = max(width - center, w0);
+  const float *s = src - center;
+  int w = w0;
+
+  // border columns
+  for (int x = 0; x < width; x++) {
+    if (x == w0)
+      x = w1;
+    if (x == width)
+      break;
+
+    float d = 0.0;
+    for (int c = -center; c <= center; c++) {
+      if (x + c >= 0 && x + c < width)
+        d += src[x + c] * k[center + c];
+    }
+    dst[x] = d;
+  }
+
+#if defined(__AVX__)
+  for (; w + 8 <= w1; w += 8) {
+    __m256 d = _mm256_setzero_ps();
+    for (int c = 0; c < n; c++) {
+      d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(s + w + c),
+                                         _mm256_set1_ps(k[c])));
+    }
+    _mm256_storeu_ps(dst + w, d);
+  }
+#endif
+#if defined(__SSE__)
+  for (; w + 4 <= w1; w += 4) {
+    __m128 d = _mm_setzero_ps();
+    for (int c = 0; c < n; c++) {
+      d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(s + w + c), _mm_set1_ps(k[c])));
+    }
+    _mm_storeu_ps(dst + w, d);
+  }
+#endif
+  for (; w < w1; w++) {
+    float d = 0.0;
+    for (int c = 0; c < n; c++) {
+      d += s[w + c] * k[c];
+    }
+    dst[w] = d;
+  }
+}
+
+/* Dispatch to the convolveRowTaps() specialized for the kernel size. */
+inline void convolveRow(const float *src, const int width, const float *k,
+                        const int center, float *dst) {
+  switch (2 * center + 1) {
+  case 3:
+    convolveRowTaps<3>(src, width, k, center, dst);
+    break;
+  case 5:
+    convolveRowTaps<5>(src, width, k, center, dst);
+    break;
+  case 7:
+    convolveRowTaps<7>(src, width, k, center, dst);
+    break;
+  case 9:
+    convolveRowTaps<9>(src, width, k, center, dst);
+    break;
+  default:
+    convolveRowTaps<0>(src, width, k, center, dst);
+  }
+}
+
+/* Weighted sum of n rows of width samples, dst[w] = sum of rows[c][w] *
+   k[c] in order of c. */
+template <typename D>
+void convolveColumns(const float *const *rows, const float *k, const int n,
+                     const int width, D *dst) {
+  for (int w = 0; w < width; w++) {
+    float d = 0.0;
+    for (int c = 0; c < n; c++) {
+      d += rows[c][w] * k[c];
+    }
+    dst[w] = (D)d;
+  }
+}
+
+/* Vectorized convolveColumns() for float output, N as convolveRowTaps(). */
+template <int N>
+void convolveColumnsTaps(const float *const *rows, const float *k,
+                         const int taps, const int width, float *dst) {
+  const int n = N ? N : taps;
+  int w = 0;
+
+#if defined(__AVX__)
+  for (; w + 8 <= width; w += 8) {
+    __m256 d = _mm256_setzero_ps();
+    for (int c = 0; c < n; c++) {
+      d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(rows[c] + w),
+                                         _mm256_set1_ps(k[c])));
+    }
+    _mm256_storeu_ps(dst + w, d);
+  }
+#endif
+#if defined(__SSE__)
+  for (; w + 4 <= width; w += 4) {
+    __m128 d = _mm_setzero_ps();
+    for (int c = 0; c < n; c++) {
+      d = _mm_add_ps(d,
+                     _mm_mul_ps(_mm_loadu_ps(rows[c] + w), _mm_set1_ps(k[c])));
+    }
+    _mm_storeu_ps(dst + w, d);
+  }
+#endif
+  for (; w < width; w++) {
+    float d = 0.0;
+    for (int c = 0; c < n; c++) {
+      d += rows[c][w] * k[c];
+    }
+    dst[w] = d;
+  }
+}
+
+/* Dispatch to the convolveColumnsTaps() specialized for the kernel size. */
+inline void convolveColumns(const float *const *rows, const float *k,
+                            const int n, const int width, float *dst) {
+  switch (n) {
+  case 3:
+    convolveColumnsTaps<3>(rows, k, n, width, dst);
+    break;
+  case 5:
+    convolveColumnsTaps<5>(rows, k, n, width, dst);
+    break;
+  case 7:
+    convolveColumnsTaps<7>(rows, k, n, width, dst);
+    break;
+  case 9:
+    convolveColumnsTaps<9>(rows, k, n, width, dst);
+    break;
+  default:
+    convolveColumnsTaps<0>(rows, k, n, width, dst);
+  }
+}
+
+/* Separable convolution with the 1-D kernel k (ksize odd) along the rows
+   and then the columns, where samples outside the image are zero.  Each
+   thread takes a band of CONV_BAND_ROWS output rows, convolves the rows of
+   the band and the center rows above and below it into a buffer that stays
+   in cache, and then sums the buffer rows under the kernel for every output
+   row, so neither pass walks down columns. */
 template <typename T> void Image<T>::convolve(const float *k, const int ksize) {
-  Image<float> temp(_width, _height);
+  Image<T> temp(_height, _width);
   int center = ksize >> 1;
 
-  // convolve with 1-D kernel in the x direction
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      float d = 0.0;
-      for (int c = -center; c <= center; c++) {
-        int wp = w + c;
-        if (wp >= 0 && wp < _width)
-          d += _data[h * _width + wp] * k[center + c];
-      }
+  parallelFor(0, _height, CONV_BAND_ROWS, [&](int h0, int h1) {
+    // convolve with 1-D kernel in the x direction
+    int r0 = max(h0 - center, 0);
+    int r1 = min(h1 + center, _height);
+    Image<float> band(r1 - r0, _width);
 
-      temp._data[w * _height + h] = (T)d; // temp is flipped
+    for (int h = r0; h < r1; h++) {
+      convolveRow(_data + h * _width, _width, k, center,
+                  &band[(h - r0) * _width]);
     }
-  }
 
-  // convolve with 1-D kernel in the y direction
-  for (int h = 0; h < temp._height; h++) {
-    for (int w = 0; w < temp._width; w++) {
-      float d = 0.0;
-      for (int c = -center; c <= center; c++) {
-        int wp = w + c;
-        if (wp >= 0 && wp < temp._width)
-          d += temp._data[h * temp._width + wp] * k[center + c];
+    // convolve with 1-D kernel in the y direction, rows outside the image
+    // are skipped
+    const float *stackRows[CONV_STACK_TAPS];
+    vector<const float *> heapRows;
+    const float **rows = stackRows;
+    if (2 * center + 1 > CONV_STACK_TAPS) {
+      heapRows.resize(2 * center + 1);
+      rows = &heapRows[0];
+    }
+    for (int h = h0; h < h1; h++) {
+      int c0 = max(-center, -h);
+      int c1 = min(center, _height - 1 - h);
+
+      for (int c = c0; c <= c1; c++) {
+        rows[c - c0] = &band[(h + c - r0) * _width];
       }
 
-      _data[w * temp._height + h] = (T)d; // destination if flipped
+      convolveColumns(rows, k + center + c0, c1 - c0 + 1, _width,
+                      temp._data + h * _width);
     }
-  }
+  });
+
+  *this = move(temp);
 }
 
+/* 2-D convolution with the kheight x kwidth kernel k, where samples outside
+   the image are zero.  KH and KW are the kernel size known at compile time,
+   so the kernel loops unroll, or 0 to use kheight and kwidth.  Pixels whose
+   whole kernel is inside the image are summed without bounds checks, in the
+   same order as the checked border pixels. */
 template <typename T>
-void Image<T>::convolve(const float *k, const int kheight, const int kwidth) {
+template <int KH, int KW>
+void Image<T>::convolve2D(const float *k, const int kheight,
+                          const int kwidth) {
+  const int kh = KH ? KH : kheight;
+  const int kw = KW ? KW : kwidth;
   Image<float> temp(_height, _width);
 
   // special case if the ksize is even
-  int kheightp = (kheight % 2) ? kheight : kheight - 1;
-  int kwidthp = (kwidth % 2) ? kwidth : kwidth - 1;
+  int top = ((kh % 2) ? kh : kh - 1) >> 1;
+  int left = ((kw % 2) ? kw : kw - 1) >> 1;
+
+  // columns whose kernel is inside the image
+  int w0 = min(left, _width);
+  int w1 = max(_width - (kw - 1 - left), w0);
 
   // convolve with 2-D kernel
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      float d = 0.0; // kernel accumulator
-
-      // loop over kernel
-      for (int i = 0; i < kheight; i++) {
-        for (int j = 0; j < kwidth; j++) {
-          int hp = h + i - (kheightp >> 1);
-          int wp = w + j - (kwidthp >> 1);
-
-          if (hp >= 0 && hp < _height && wp >= 0 && wp < _width) {
-            d += _data[hp * _width + wp] * k[i * kwidth + j];
+  parallelFor(0, _height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      bool rowInside = (h - top >= 0 && h - top + kh <= _height);
+
+      for (int w = 0; w < _width; w++) {
+        float d = 0.0; // kernel accumulator
+
+        if (rowInside && w >= w0 && w < w1) {
+          const T *p = _data + (h - top) * _width + (w - left);
+          for (int i = 0; i < kh; i++) {
+            for (int j = 0; j < kw; j++) {
+              d += p[i * _width + j] * k[i * kw + j];
+            }
+          }
+        } else {
+          // loop over kernel
+          for (int i = 0; i < kh; i++) {
+            for (int j = 0; j < kw; j++) {
+              int hp = h + i - top;
+              int wp = w + j - left;
+
+              if (hp >= 0 && hp < _height && wp >= 0 && wp < _width) {
+                d += _data[hp * _width + wp] * k[i * kw + j];
+              }
+            }
           }
         }
-      }
 
-      temp._data[h * _width + w] = (T)d; // temp is flipped
+        temp._data[h * _width + w] = (T)d;
+      }
     }
-  }
+  });
 
-  // copy convolved image to this image
-  *this = temp;
+  // move convolved image to this image
+  *this = move(temp);
+}
+
+/* 2-D convolution dispatched to the specializations for the fixed kernels
+   of this code, the 2x2 derivative, 3x3 laplacian and 5x5 kernels. */
+template <typename T>
+void Image<T>::convolve(const float *k, const int kheight, const int kwidth) {
+  if (kheight == 2 && kwidth == 2)
+    convolve2D<2, 2>(k, kheight, kwidth);
+  else if (kheight == 3 && kwidth == 3)
+    convolve2D<3, 3>(k, kheight, kwidth);
+  else if (kheight == 5 && kwidth == 5)
+    convolve2D<5, 5>(k, kheight, kwidth);
+  else
+    convolve2D<0, 0>(k, kheight, kwidth);
 }
 
 template <typename T> T Image<T>::sum() const {
@@ -75,89 +293,166 @@ template <typename T> T Image<T>::sum() const {
   return (s);
 }
 
-template <typename T> Image<T> Image<T>::operator+(const Image<T> &im) const {
-  Image<T> temp(_height, _width);
+template <typename T>
+template <typename E>
+Image<T>::Image(const ImageExpr<E> &e)
+    : _data(0), _height(0), _width(0) {
+  *this = e;
+}
 
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      int ind = h * _width + w;
-      temp._data[ind] = _data[ind] + im._data[ind];
-    }
-  }
+template <typename T>
+template <typename E>
+Image<T> &Image<T>::operator=(const ImageExpr<E> &e) {
+  static_assert(is_same<typename E::value_type, T>::value,
+                "image expression of another pixel type");
+  const E &x = e.self();
+
+  if (x.height() != _height || x.width() != _width) {
+    // the expression may read this image, so evaluate it into new storage
+    Image<T> temp;
+    temp.allocate(x.height(), x.width());
+    temp.assign(x);
+    *this = move(temp);
+  } else {
+    // pixel i only reads pixel i of the operands, so this may be one of them
+    assign(x);
+  }
+
+  return (*this);
+}
 
-  return (temp);
+template <typename T>
+template <typename E>
+void Image<T>::assign(const E &x) {
+  parallelFor(0, _height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int i = h0 * _width; i < h1 * _width; i++) {
+      _data[i] = x.eval(i);
+    }
+  });
 }
 
-template <typename T> Image<T> Image<T>::operator-(const Image<T> &im) const {
-  Image<T> temp(_height, _width);
+template <typename L, typename R>
+ImageBinaryExpr<L, R, ImageAdd_t> operator+(const ImageExpr<L> &l,
+                                            const ImageExpr<R> &r) {
+  return (ImageBinaryExpr<L, R, ImageAdd_t>(l.self(), r.self()));
+}
 
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      int ind = h * _width + w;
-      temp._data[ind] = _data[ind] - im._data[ind];
-    }
-  }
+template <typename L, typename R>
+ImageBinaryExpr<L, R, ImageSub_t> operator-(const ImageExpr<L> &l,
+                                            const ImageExpr<R> &r) {
+  return (ImageBinaryExpr<L, R, ImageSub_t>(l.self(), r.self()));
+}
 
-  return (temp);
+template <typename L, typename R>
+ImageBinaryExpr<L, R, ImageMul_t> operator*(const ImageExpr<L> &l,
+                                            const ImageExpr<R> &r) {
+  return (ImageBinaryExpr<L, R, ImageMul_t>(l.self(), r.self()));
 }
 
-template <typename T> Image<T> Image<T>::operator*(const Image<T> &im) const {
-  Image<T> temp(_height, _width);
+template <typename E>
+ImageScaleExpr<E> operator*(const ImageExpr<E> &e,
+                            const typename E::value_type &val) {
+  return (ImageScaleExpr<E>(e.self(), val));
+}
 
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      int ind = h * _width + w;
-      temp._data[ind] = _data[ind] * im._data[ind];
+/* 1-D convolution of one row of width samples with the 2 * center + 1
+   taps of k at every other sample, dst[x] is the convolveRow() sum at
+   sample 2x, for the dw = ceil(width / 2) kept samples.  N is the number of
+   taps known at compile time or 0, as for convolveRowTaps(). */
+template <int N, typename S>
+void convolveRowDecimate(const S *src, const int width, const float *k,
+                         const int center, float *dst, const int dw) {
+  const int n = N ? N : 2 * center + 1;
+
+  for (int x = 0; x < dw; x++) {
+    int w = 2 * x;
+    float d = 0.0;
+
+    if (w - center >= 0 && w + center < width) {
+      // every tap inside the row
+      const S *s = src + w - center;
+      for (int c = 0; c < n; c++) {
+        d += s[c] * k[c];
+      }
+    } else {
+      for (int c = -center; c <= center; c++) {
+        int wp = w + c;
+        if (wp >= 0 && wp < width)
+          d += src[wp] * k[center + c];
+      }
     }
-  }
 
-  return (temp);
+    dst[x] = d;
+  }
 }
 
-template <typename T> Image<T> Image<T>::operator*(const T &val) const {
-  Image<T> temp(_height, _width);
+/* Blur with the separable 1-D kernel k (ksize odd) and keep every other row
+   and column, dst is ceil(height / 2) x ceil(width / 2).  The result is the
+   same as convolve() followed by taking the even samples, but only the kept
+   samples are filtered: the rows are filtered at the even columns and the
+   columns only at the even rows, each thread taking a band of output rows
+   as in convolve().  This image is not changed. */
+template <typename T>
+void Image<T>::decimate2(const float *k, const int ksize,
+                         Image<T> *dst) const {
+  int center = ksize >> 1;
+  int hp = (_height + 1) / 2;
+  int wp = (_width + 1) / 2;
+
+  dst->init(hp, wp);
+
+  parallelFor(0, hp, CONV_BAND_ROWS, [&](int h0, int h1) {
+    // rows of this image under the kernel of output rows [h0, h1)
+    int r0 = max(2 * h0 - center, 0);
+    int r1 = min(2 * (h1 - 1) + center + 1, _height);
+    Image<float> band(r1 - r0, wp);
+
+    for (int r = r0; r < r1; r++) {
+      float *b = &band[(r - r0) * wp];
+      if (ksize == 5)
+        convolveRowDecimate<5>(_data + r * _width, _width, k, center, b, wp);
+      else
+        convolveRowDecimate<0>(_data + r * _width, _width, k, center, b, wp);
+    }
 
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      int ind = h * _width + w;
-      temp._data[ind] = _data[ind] * val;
+    // columns at the even rows, rows outside the image are skipped
+    const float *stackRows[CONV_STACK_TAPS];
+    vector<const float *> heapRows;
+    const float **rows = stackRows;
+    if (2 * center + 1 > CONV_STACK_TAPS) {
+      heapRows.resize(2 * center + 1);
+      rows = &heapRows[0];
     }
-  }
+    for (int h = h0; h < h1; h++) {
+      int y = 2 * h;
+      int c0 = max(-center, -y);
+      int c1 = min(center, _height - 1 - y);
 
-  return (temp);
+      for (int c = c0; c <= c1; c++) {
+        rows[c - c0] = &band[(y + c - r0) * wp];
+      }
+
+      convolveColumns(rows, k + center + c0, c1 - c0 + 1, wp,
+                      dst->_data + h * wp);
+    }
+  });
 }
 
+/* Gaussian pyramid of levels levels, where py[0] is a copy of this image and
+   each level is the previous one blurred with a 5-tap binomial-like kernel
+   and decimated by two (rounding the dimensions up).  The stored levels are
+   not blurred in place, so py[l] is the unfiltered input of py[l + 1]. */
 template <typename T>
 void Image<T>::pyramid(const int levels, vector<Image<T> > &py) const {
   float a = 0.375;
   float k[] = {0.25 - a / 2.0, 0.25, a, 0.25, 0.25 - a / 2.0};
-  Image<T> temp;
 
-  py.clear();          // clear return vector
-  py.push_back(*this); // add first level
+  // levels of a previous pyramid of the same size keep their storage
+  py.resize(max(levels, 1));
+  py[0] = *this; // add first level
 
-  int hp = _height;
-  int wp = _width;
   for (int l = 1; l < levels; l++) {
-    // alloc new image with 1/2 dim.
-    hp = ceil(hp / 2.0);
-    wp = ceil(wp / 2.0);
-    temp.init(hp, wp);
-
-    // filter last image
-    Image<T> &t = py.back();
-    t.convolve(k, 5);
-
-    // subsample last image
-    for (int h = 0; h < temp.height(); h++) {
-      for (int w = 0; w < temp.width(); w++) {
-        int h_2 = 2 * h;
-        int w_2 = 2 * w;
-        temp._data[h * temp.width() + w] = t.getPixel(h_2 * t.width() + w_2);
-      }
-    }
-
-    py.push_back(temp);
+    py[l - 1].decimate2(k, 5, &py[l]);
   }
 }
 
@@ -166,14 +461,16 @@ template <typename T> Image<T> Image<T>::upsample2() const {
   int wp = 2 * _width;
   Image<T> temp(hp, wp);
 
-  for (int h = 0; h < hp; h++) {
-    for (int w = 0; w < wp; w++) {
-      float hc = h / 2.0;
-      float wc = w / 2.0;
+  parallelFor(0, hp, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < wp; w++) {
+        float hc = h / 2.0;
+        float wc = w / 2.0;
 
-      temp._data[h * wp + w] = bilinear(hc, wc);
+        temp._data[h * wp + w] = bilinear(hc, wc);
+      }
     }
-  }
+  });
 
   return (temp);
 }
@@ -288,164 +585,6 @@ template <> void Image<RGB_t>::writeToFile(const string &fname) const {
   ofile.close();
 }
 
-template <> void Image<Vec2f_t>::writeToFile(const string &fname) const {
-  ofstream ofile;
-  int spac = 10;
-
-  // allocate space
-  unsigned char *img = new unsigned char[_height * _width];
-  memset(img, 0, _height * _width * sizeof(unsigned char));
-
-  // construct the graphical vector field
-  for (int h = 0; h < _height; h += spac) {
-    for (int w = 0; w < _width; w += spac) {
-      int ex = w + _data[h * _width + w][0];
-      int ey = h + _data[h * _width + w][1];
-
-      if (ex >= 0 && ex < _width && ey >= 0 && ey < _height) {
-        drawLine(w, h, ex, ey, (unsigned char)255, _height, _width, img);
-      }
-    }
-  }
-
-  // open file and check
-  ofile.open(fname.c_str());
-  if (!ofile) {
-    throw(Exception("unable to open file for writing"));
-  }
-
-  // write to file
-  ofile << "P5" << endl << _width << " " << _height << endl << "255" << endl;
-  ofile.write((char *)img, _width * _height * sizeof(unsigned char));
-  ofile.close();
-
-  delete[] img;
-}
-
-#if 0
-template<>
-void Image<Vec2f_t>::writeToFile(
-  const string &fname
-  ) const
-{
-  ofstream ofile;
-  int spac = 10;
-
-  // allocate space
-  Image<float> img(_height, _width);
-
-  // construct the graphical vector field
-  for(int h = 0; h < _height; h += spac)
-  {
-    for(int w = 0; w < _width; w += spac)
-    {
-      float v = sqrt(_data[h * _width + w][0] * _data[h * _width + w][0] +
-                     _data[h * _width + w][1] * _data[h * _width + w][1]);
-      img.setPixel(h * _width + w, v);
-    }
-  }
-
-  img.writeToFile(fname);
-}
-#endif
-
-template <typename T>
-void Image<T>::writeToFile(const string &fname, const float *textimg) const {
-  throw Exception("not implemented");
-}
-
-template <>
-void Image<Vec2f_t>::writeToFile(const string &fname,
-                                 const float *textimg) const {
-  ofstream ofile;
-  vector<int> p_x, p_y;
-  int p0_x, p0_y, p1_x, p1_y;
-  float dist = 5.0;
-
-  // allocate space
-  float *accimg = new float[_height * _width];
-  memset(accimg, 0, _height * _width * sizeof(float));
-
-  // allocate space for magnitudes
-  float *magimg = new float[_height * _width];
-  memset(magimg, 0, _height * _width * sizeof(float));
-
-  // integrate vectors
-  float v, mag, sqrt_2 = sqrt(2.0);
-  for (int h = 0; h < _height; h++) {
-    for (int w = 0; w < _width; w++) {
-      mag = sqrt(_data[h * _width + w][0] * _data[h * _width + w][0] +
-                 _data[h * _width + w][1] * _data[h * _width + w][1]);
-
-      // remove vectors less than one 8-connected pixel
-      if (mag < sqrt_2)
-        continue;
-
-      magimg[h * _width + w] = mag;
-
-      p0_x = int(w + _data[h * _width + w][0] / mag * dist + 0.5);
-      p0_y = int(h + _data[h * _width + w][1] / mag * dist + 0.5);
-      p1_x = int(w - _data[h * _width + w][0] / mag * dist + 0.5);
-      p1_y = int(h - _data[h * _width + w][1] / mag * dist + 0.5);
-
-      getLinePts(p0_x, p0_y, p1_x, p1_y, p_x, p_y);
-
-      v = 0;
-      for (unsigned i = 0; i < p_x.size(); i++) {
-        int hp = p_y[i];
-        int wp = p_x[i];
-
-        if (hp >= 0 && hp < _height && wp >= 0 && wp < _width) {
-          v += textimg[hp * _width + wp];
-        }
-      }
-
-      accimg[h * _width + w] = v;
-    }
-  }
-
-  // convolve vector directions with strength
-  for (int i = 0; i < _width * _height; i++) {
-    accimg[i] *= magimg[i];
-  }
-
-  // get stats
-  float min = accimg[0];
-  float max = accimg[0];
-  for (int i = 0; i < _width * _height; i++) {
-    if (min > accimg[i])
-      min = accimg[i];
-    if (max < accimg[i])
-      max = accimg[i];
-  }
-
-  // open file and check
-  ofile.open(fname.c_str());
-  if (!ofile) {
-    throw(Exception("unable to open file for writing"));
-  }
-
-  ofile << "P6\n" << _width << " " << _height << "\n255\n";
-
-  // scale factor
-  float scale = 1.0;
-  if (max - min > 0.01)
-    scale = 255.0 / (max - min);
-
-  // write to file
-  for (int i = 0; i < _width * _height; i++) {
-    unsigned char val;
-    val = scale * (accimg[i] - min) + 0.5;
-    ofile.write((char *)&jetBlackMap[val][0], sizeof(unsigned char));
-    ofile.write((char *)&jetBlackMap[val][1], sizeof(unsigned char));
-    ofile.write((char *)&jetBlackMap[val][2], sizeof(unsigned char));
-  }
-
-  ofile.close();
-
-  delete[] accimg;
-}
-
 Image<float> *getChannel(const Image<RGB_t> *img, const int &n) {
   Image<float> *rtn = new Image<float>(img->height(), img->width());
   int numElems = img->height() * img->width();
@@ -459,19 +598,6 @@ Image<float> *getChannel(const Image<RGB_t> *img, const int &n) {
   return (rtn);
 }
 
-Image<float> *getChannel(const Image<Vec2f_t> *img, const int &n) {
-  Image<float> *rtn = new Image<float>(img->height(), img->width());
-  int numElems = img->height() * img->width();
-  float v;
-
-  for (int i = 0; i < numElems; i++) {
-    v = img->getPixel(i).v[n];
-    rtn->setPixel(i, v);
-  }
-
-  return (rtn);
-}
-
 Image<float> *computeBrightness(const Image<RGB_t> *im) {
   Image<float> *rtn = new Image<float>(im->height(), im->width());
   int numElems = im->height() * im->width();
@@ -487,31 +613,3 @@ Image<float> *computeBrightness(const Image<RGB_t> *im) {
 
   return (rtn);
 }
-
-// compute magnitude and direction channels
-Image<float> *getMagnitude(const Image<Vec2f_t> *vfield) {
-  Image<float> *rtn = new Image<float>(vfield->height(), vfield->width());
-  int numElems = vfield->height() * vfield->width();
-
-  for (int i = 0; i < numElems; i++) {
-    float v = vfield->getPixel(i).v[0] * vfield->getPixel(i).v[0] +
-              vfield->getPixel(i).v[1] * vfield->getPixel(i).v[1];
-
-    rtn->setPixel(i, sqrt(v));
-  }
-
-  return (rtn);
-}
-
-// compute magnitude and direction channels
-Image<float> *getDirection(const Image<Vec2f_t> *vfield) {
-  Image<float> *rtn = new Image<float>(vfield->height(), vfield->width());
-  int numElems = vfield->height() * vfield->width();
-
-  for (int i = 0; i < numElems; i++) {
-    float v = atan2(vfield->getPixel(i).v[1], vfield->getPixel(i).v[0]);
-    rtn->setPixel(i, v);
-  }
-
-  return (rtn);
-}
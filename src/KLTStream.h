@@ -0,0 +1,59 @@
+#ifndef _KLTSTREAM_H_
+#define _KLTSTREAM_H_
+
+#include <vector>
+
+#include "Exception.h"
+#include "Image.h"
+#include "sparseFlow.h"
+
+using namespace std;
+
+/* Sparse KLT tracking over a stream of frames.  Every frame is the current
+   image of one pair and the previous image of the next, so the gaussian
+   pyramid of each frame is built once, when it is added, and kept for the
+   following pair.  Points handed in are tracked as they are, and corners
+   are only selected when the point list is empty, so carrying the tracked
+   points on with advancePoints_KLT() skips the corner search altogether. */
+class KLTStream {
+private:
+  FramePyramid_t prev, curr; // pyramids of the last two frames
+  bool havePrev;             // prev holds a frame
+  KLTParams_t params;        // tracker options
+
+public:
+  KLTStream(const KLTParams_t &p = KLTParams_t())
+      : havePrev(false), params(p) {}
+
+  // forget the previous frame, e.g. at a cut
+  void reset() { havePrev = false; }
+
+  /* Add the next frame.  Returns false for the first frame of the stream,
+     otherwise tracks points from the previous frame to this one, after
+     selecting the corners of the previous frame if points is empty, and
+     returns true. */
+  bool addFrame(const Image<float> *img, vector<FeaturePoint_t> *points) {
+    buildPyramid_KLT(img, params, &curr);
+
+    bool computed = havePrev;
+    if (computed) {
+      if (img->height() != prev.levels[0].height() ||
+          img->width() != prev.levels[0].width()) {
+        throw Exception("frame dimensions changed within a KLT stream");
+      }
+
+      if (points->empty()) {
+        selectCorners_KLT(&prev, params, points);
+      }
+      trackPoints_KLT(&prev, &curr, params, points);
+    }
+
+    // the current frame is the previous frame of the next pair
+    prev.levels.swap(curr.levels);
+    havePrev = true;
+
+    return (computed);
+  }
+};
+
+#endif // _KLTSTREAM_H_
@@ -0,0 +1,103 @@
+#ifndef _PADDEDIMAGE_H_
+#define _PADDEDIMAGE_H_
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "BufferPool.h"
+#include "Exception.h"
+#include "Image.h"
+
+using namespace std;
+
+// alignment in bytes of every row of a padded image
+const int PADDED_ALIGN = 64;
+
+// how the border apron of a padded image is filled
+enum { BORDER_ZERO = 0, BORDER_REPLICATE };
+
+/* Image storage with rows aligned to PADDED_ALIGN bytes, a padded row
+   stride and an apron of border pixels on every side.  Pixel (h, w) is
+   addressable for h in [-border, height + border) and w in
+   [-border, width + border), so kernels whose footprint stays within the
+   apron need no bounds checks.  The apron is filled from the image with
+   zeros or by replicating the edge pixels.  This is a working copy for
+   kernels that read an Image<T> many times; T must be a plain type.  The
+   storage comes from the BufferPool. */
+template <typename T> class PaddedImage {
+private:
+  T *_alloc;           // aligned allocation including the apron
+  T *_origin;          // pixel (0, 0)
+  int _height, _width; // image dimensions
+  int _border;         // apron width in pixels
+  int _stride;         // elements between rows
+
+public:
+  PaddedImage()
+      : _alloc(0), _origin(0), _height(0), _width(0), _border(0),
+        _stride(0) {}
+
+  PaddedImage(const int h, const int w, const int border)
+      : _alloc(0), _origin(0), _height(0), _width(0), _border(0),
+        _stride(0) {
+    init(h, w, border);
+  }
+
+  ~PaddedImage() { clear(); }
+
+  void init(const int h, const int w, const int border);
+
+  void clear() {
+    if (_alloc) {
+      size_t n = (size_t)(_height + 2 * _border) * _stride * sizeof(T);
+      BufferPool::instance().release(_alloc, max(n, (size_t)1));
+    }
+    _alloc = _origin = 0;
+    _height = _width = _border = _stride = 0;
+  }
+
+  int height() const { return (_height); }
+
+  int width() const { return (_width); }
+
+  int border() const { return (_border); }
+
+  int stride() const { return (_stride); }
+
+  // pointer to pixel (h, 0), h may be in the apron
+  T *row(const int h) const { return (_origin + h * _stride); }
+
+  T &at(const int h, const int w) const { return (_origin[h * _stride + w]); }
+
+  // true if rows [h0, h1] and columns [w0, w1] are all addressable
+  bool inApron(const int h0, const int w0, const int h1, const int w1) const {
+    return (h0 >= -_border && w0 >= -_border && h1 < _height + _border &&
+            w1 < _width + _border);
+  }
+
+  void copyFrom(const Image<T> *img, const int mode);
+
+  void copyTo(Image<T> *img) const;
+
+  void fillBorder(const int mode);
+
+  // bilinear sample, (h, w) and (h + 1, w + 1) must be addressable
+  T bilinear(const float h, const float w) const;
+
+  // bilinear sample at (h, w) clamped to the apron
+  T sample(float h, float w) const {
+    h = min(max(h, (float)-_border), (float)(_height + _border - 2));
+    w = min(max(w, (float)-_border), (float)(_width + _border - 2));
+    return (bilinear(h, w));
+  }
+
+  // not copyable
+  PaddedImage(const PaddedImage<T> &) = delete;
+  PaddedImage<T> &operator=(const PaddedImage<T> &) = delete;
+};
+
+#include "PaddedImage.inl"
+
+#endif // _PADDEDIMAGE_H_
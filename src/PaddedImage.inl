@@ -0,0 +1,101 @@
+/* Allocate an h x w image with a border pixel apron.  The left apron is
+   rounded up so pixel (h, 0) of every row is aligned, and the stride is
+   rounded up to a whole number of aligned blocks.  Storage is reused if the
+   layout does not change; the contents are not initialized. */
+template <typename T>
+void PaddedImage<T>::init(const int h, const int w, const int border) {
+  int align = max(PADDED_ALIGN / (int)sizeof(T), 1);
+  int left = (border + align - 1) / align * align;
+  int stride = (left + w + border + align - 1) / align * align;
+
+  if (_alloc && h == _height && w == _width && border == _border &&
+      stride == _stride) {
+    return; // reuse storage
+  }
+
+  clear();
+
+  // pooled buffers are aligned to POOL_ALIGN >= PADDED_ALIGN bytes
+  size_t n = (size_t)(h + 2 * border) * stride * sizeof(T);
+  _alloc = (T *)BufferPool::instance().acquire(max(n, (size_t)1));
+  _height = h;
+  _width = w;
+  _border = border;
+  _stride = stride;
+  _origin = _alloc + border * _stride + left;
+}
+
+/* Copy img into the interior, resizing if needed, and fill the apron. */
+template <typename T>
+void PaddedImage<T>::copyFrom(const Image<T> *img, const int mode) {
+  init(img->height(), img->width(), _border);
+
+  for (int h = 0; h < _height; h++) {
+    memcpy(row(h), &(*img)[h * _width], _width * sizeof(T));
+  }
+
+  fillBorder(mode);
+}
+
+/* Copy the interior to img. */
+template <typename T> void PaddedImage<T>::copyTo(Image<T> *img) const {
+  img->init(_height, _width);
+
+  for (int h = 0; h < _height; h++) {
+    memcpy(&(*img)[h * _width], row(h), _width * sizeof(T));
+  }
+}
+
+/* Fill the apron with zeros or with the nearest edge pixel. */
+template <typename T> void PaddedImage<T>::fillBorder(const int mode) {
+  if (_height == 0 || _width == 0)
+    return;
+
+  // left and right of every image row
+  for (int h = 0; h < _height; h++) {
+    T *r = row(h);
+    T lv = (mode == BORDER_REPLICATE) ? r[0] : (T)0;
+    T rv = (mode == BORDER_REPLICATE) ? r[_width - 1] : (T)0;
+
+    for (int w = -_border; w < 0; w++) {
+      r[w] = lv;
+    }
+    for (int w = _width; w < _width + _border; w++) {
+      r[w] = rv;
+    }
+  }
+
+  // whole rows above and below, including the corners
+  for (int h = -_border; h < 0; h++) {
+    if (mode == BORDER_REPLICATE)
+      memcpy(row(h) - _border, row(0) - _border,
+             (_width + 2 * _border) * sizeof(T));
+    else
+      memset(row(h) - _border, 0, (_width + 2 * _border) * sizeof(T));
+  }
+  for (int h = _height; h < _height + _border; h++) {
+    if (mode == BORDER_REPLICATE)
+      memcpy(row(h) - _border, row(_height - 1) - _border,
+             (_width + 2 * _border) * sizeof(T));
+    else
+      memset(row(h) - _border, 0, (_width + 2 * _border) * sizeof(T));
+  }
+}
+
+/* Bilinear interpolation without bounds checks, the same weights as
+   Image<T>::bilinear() for samples inside the image. */
+template <typename T>
+T PaddedImage<T>::bilinear(const float h, const float w) const {
+  int lr = (int)floor(h);
+  int lc = (int)floor(w);
+  int ur = lr + 1;
+  int uc = lc + 1;
+
+  const T *r0 = row(lr);
+  const T *r1 = row(ur);
+
+  T t0 = (uc - w) * r0[lc] + (w - lc) * r0[uc];
+  T t1 = (uc - w) * r1[lc] + (w - lc) * r1[uc];
+
+  return ((ur - h) * t0 + (h - lr) * t1);
+}
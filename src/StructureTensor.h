@@ -0,0 +1,91 @@
+#ifndef _STRUCTURETENSOR_H_
+#define _STRUCTURETENSOR_H_
+
+#include <algorithm>
+#include <string.h>
+
+#include "BufferPool.h"
+#include "Image.h"
+
+// number of image rows accumulated and solved together
+const int TENSOR_BAND_ROWS = 32;
+
+/* Windowed sums of the five Lucas and Kanade structure tensor terms for a
+   band of image rows.  The five channels of one row are stored next to each
+   other (row r, channel c starts at (r * NUM_CHANNELS + c) * width) so a
+   band is a single block of memory that stays in cache between the windowed
+   accumulation and the 2x2 solve.  The band is taken from the BufferPool, so
+   the per-band tensors of every frame reuse the same buffers. */
+class StructureTensor {
+private:
+  float *_data;      // channel rows for the band
+  double *_colSum;   // running column sums, one row per channel
+  int _rows, _width; // band dimensions
+
+public:
+  // channel order within a row
+  enum { DX_2 = 0, DY_2, DXY, DXT, DYT, NUM_CHANNELS };
+
+  StructureTensor() : _data(0), _colSum(0), _rows(0), _width(0) {}
+
+  // not copyable
+  StructureTensor(const StructureTensor &) = delete;
+  StructureTensor &operator=(const StructureTensor &) = delete;
+
+  StructureTensor(const int rows, const int width)
+      : _data(0), _colSum(0), _rows(0), _width(0) {
+    init(rows, width);
+  }
+
+  ~StructureTensor() { clear(); }
+
+  void init(const int rows, const int width) {
+    if (_data && rows == _rows && width == _width) {
+      return; // reuse storage
+    }
+
+    clear();
+    _rows = rows;
+    _width = width;
+    _data = (float *)BufferPool::instance().acquire(dataBytes());
+    _colSum = (double *)BufferPool::instance().acquire(colSumBytes());
+    memset(_data, 0, dataBytes());
+  }
+
+  void clear() {
+    BufferPool::instance().release(_data, dataBytes());
+    BufferPool::instance().release(_colSum, colSumBytes());
+    _rows = _width = 0;
+    _data = 0;
+    _colSum = 0;
+  }
+
+  int rows() const { return (_rows); }
+
+  int width() const { return (_width); }
+
+  // pointer to channel c of band row r
+  float *row(const int r, const int c) const {
+    return (_data + (r * NUM_CHANNELS + c) * _width);
+  }
+
+  void accumulate(const Image<float> *dx, const Image<float> *dy,
+                  const Image<float> *dt, const int winSize, const int h0,
+                  const int h1);
+
+private:
+  size_t dataBytes() const {
+    return ((size_t)_rows * NUM_CHANNELS * _width * sizeof(float));
+  }
+
+  size_t colSumBytes() const {
+    return ((size_t)NUM_CHANNELS * _width * sizeof(double));
+  }
+
+  void addRow(const Image<float> *dx, const Image<float> *dy,
+              const Image<float> *dt, const int h, const double sign);
+};
+
+#include "StructureTensor.inl"
+
+#endif // _STRUCTURETENSOR_H_
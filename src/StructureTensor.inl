@@ -0,0 +1,86 @@
+/* Add (sign = 1) or remove (sign = -1) the tensor terms of image row h to
+   the running column sums. */
+void StructureTensor::addRow(const Image<float> *dx, const Image<float> *dy,
+                             const Image<float> *dt, const int h,
+                             const double sign) {
+  const float *x = &(*dx)[h * _width];
+  const float *y = &(*dy)[h * _width];
+  const float *t = &(*dt)[h * _width];
+  double *s_dx_2 = _colSum + DX_2 * _width;
+  double *s_dy_2 = _colSum + DY_2 * _width;
+  double *s_dxy = _colSum + DXY * _width;
+  double *s_dxt = _colSum + DXT * _width;
+  double *s_dyt = _colSum + DYT * _width;
+
+  for (int w = 0; w < _width; w++) {
+    float ex = x[w];
+    float ey = y[w];
+    float et = t[w];
+
+    s_dx_2[w] += sign * (ex * ex);
+    s_dy_2[w] += sign * (ey * ey);
+    s_dxy[w] += sign * (ex * ey);
+    s_dxt[w] += sign * (ex * et);
+    s_dyt[w] += sign * (ey * et);
+  }
+}
+
+/* Sum the tensor terms computed from the derivative images dx, dy and dt
+   over a winSize x winSize window about each pixel of image rows [h0, h1).
+   Row h of the image is stored in band row h - h0.  The window placement
+   and zero border are the same as Image<T>::convolve() with a kernel of all
+   ones, and all five channels are accumulated in one pass using running
+   sums. */
+void StructureTensor::accumulate(const Image<float> *dx,
+                                 const Image<float> *dy,
+                                 const Image<float> *dt, const int winSize,
+                                 const int h0, const int h1) {
+  int height = dx->height();
+
+  if (dx->width() != _width || h1 - h0 > _rows) {
+    throw Exception("image band does not fit the structure tensor");
+  }
+
+  // window extents about the center pixel
+  int top = ((winSize % 2) ? winSize : winSize - 1) >> 1;
+  int bottom = winSize - 1 - top;
+  int left = top;
+  int right = bottom;
+
+  // column sums for the window about the first row of the band
+  memset(_colSum, 0, NUM_CHANNELS * _width * sizeof(double));
+  for (int h = max(0, h0 - top); h <= h0 + bottom && h < height; h++) {
+    addRow(dx, dy, dt, h, 1.0);
+  }
+
+  for (int h = h0; h < h1; h++) {
+    // running sum along the row of each channel
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+      const double *cs = _colSum + c * _width;
+      float *dst = row(h - h0, c);
+
+      double s = 0.0;
+      for (int w = 0; w <= right && w < _width; w++) {
+        s += cs[w];
+      }
+
+      for (int w = 0; w < _width; w++) {
+        dst[w] = (float)s;
+
+        // slide window one pixel to the right
+        if (w + right + 1 < _width)
+          s += cs[w + right + 1];
+        if (w - left >= 0)
+          s -= cs[w - left];
+      }
+    }
+
+    // slide window one row down
+    if (h + 1 < h1) {
+      if (h + bottom + 1 < height)
+        addRow(dx, dy, dt, h + bottom + 1, 1.0);
+      if (h - top >= 0)
+        addRow(dx, dy, dt, h - top, -1.0);
+    }
+  }
+}
@@ -0,0 +1,212 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// default number of image rows handed to a thread at a time
+const int PARALLEL_ROWS = 16;
+
+/* Loop body of a parallel loop, a reference to a callable f(lo, hi).  The
+   callable is not copied, so starting a loop allocates no memory. */
+struct LoopBody_t {
+  const void *obj;                      // the callable
+  void (*call)(const void *, int, int); // calls obj with (lo, hi)
+
+  template <typename F> static void invoke(const void *f, int lo, int hi) {
+    (*static_cast<const F *>(f))(lo, hi);
+  }
+
+  void operator()(const int lo, const int hi) const { call(obj, lo, hi); }
+};
+
+/* Persistent pool of worker threads used to run loops over image rows in
+   parallel.  The range of a loop is cut into fixed chunks of grain
+   iterations which the calling thread and the workers take in turn, so the
+   work done for each chunk does not depend on the number of threads and
+   results are identical to running the chunks serially.
+
+   Note: A loop started from inside another parallel loop, or while another
+         thread is using the pool, runs serially on the calling thread. */
+class ThreadPool {
+private:
+  vector<thread> workers;     // worker threads (the caller is not included)
+  mutex poolMutex;            // guards the job state below
+  mutex callMutex;            // one parallel loop at a time
+  condition_variable startCv; // signals workers that a job is ready
+  condition_variable doneCv;  // signals the caller that workers finished
+
+  const LoopBody_t *job;          // loop body for [lo, hi) chunks
+  int jobBegin, jobEnd, jobGrain; // loop range and chunk size
+  atomic<int> nextChunk;          // next chunk to be taken
+  int active;                     // workers still on the current job
+  unsigned generation;            // incremented for every job
+  bool stopping;                  // workers should exit
+  exception_ptr error;            // first exception thrown by the job
+
+  static bool &inWorker() {
+    static thread_local bool flag = false;
+    return (flag);
+  }
+
+  // take chunks of the current job until none are left
+  void runChunks() {
+    int numChunks = (jobEnd - jobBegin + jobGrain - 1) / jobGrain;
+    int c;
+
+    while ((c = nextChunk.fetch_add(1)) < numChunks) {
+      int lo = jobBegin + c * jobGrain;
+      int hi = min(lo + jobGrain, jobEnd);
+
+      try {
+        (*job)(lo, hi);
+      } catch (...) {
+        lock_guard<mutex> lock(poolMutex);
+        if (!error)
+          error = current_exception();
+      }
+    }
+  }
+
+  // seen is the job generation when the worker was started
+  void workerLoop(unsigned seen) {
+    inWorker() = true;
+
+    while (true) {
+      {
+        unique_lock<mutex> lock(poolMutex);
+        while (!stopping && generation == seen) {
+          startCv.wait(lock);
+        }
+        if (stopping)
+          return;
+        seen = generation;
+      }
+
+      runChunks();
+
+      {
+        lock_guard<mutex> lock(poolMutex);
+        if (--active == 0)
+          doneCv.notify_one();
+      }
+    }
+  }
+
+  void stopWorkers() {
+    {
+      lock_guard<mutex> lock(poolMutex);
+      stopping = true;
+    }
+    startCv.notify_all();
+
+    for (unsigned i = 0; i < workers.size(); i++) {
+      workers[i].join();
+    }
+    workers.clear();
+    stopping = false;
+  }
+
+  ThreadPool()
+      : job(0), jobBegin(0), jobEnd(0), jobGrain(1), nextChunk(0), active(0),
+        generation(0), stopping(false) {
+    setNumThreads(thread::hardware_concurrency());
+  }
+
+public:
+  // not copyable
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() { stopWorkers(); }
+
+  // pool shared by all the image and optical flow kernels
+  static ThreadPool &instance() {
+    static ThreadPool pool;
+    return (pool);
+  }
+
+  // total number of threads used by a loop, including the calling thread
+  int numThreads() const { return (workers.size() + 1); }
+
+  // set the total number of threads (1 runs every loop serially)
+  void setNumThreads(int n) {
+    lock_guard<mutex> call(callMutex);
+
+    stopWorkers();
+    for (int i = 1; i < n; i++) {
+      workers.push_back(thread(&ThreadPool::workerLoop, this, generation));
+    }
+  }
+
+  /* Call f(lo, hi) for consecutive chunks [lo, hi) of at most grain
+     iterations covering [begin, end), using all threads of the pool. */
+  template <typename F>
+  void parallelFor(const int begin, const int end, const int grain,
+                   const F &f) {
+    LoopBody_t body = {&f, &LoopBody_t::invoke<F>};
+    run(begin, end, grain, body);
+  }
+
+  // parallelFor() of a loop body
+  void run(const int begin, const int end, const int grain,
+           const LoopBody_t &f) {
+    int g = max(grain, 1);
+
+    if (end <= begin)
+      return;
+
+    unique_lock<mutex> call(callMutex, try_to_lock);
+    if (!call.owns_lock() || inWorker() || workers.empty() ||
+        end - begin <= g) {
+      // run serially in the same chunks
+      for (int lo = begin; lo < end; lo += g) {
+        f(lo, min(lo + g, end));
+      }
+      return;
+    }
+
+    {
+      lock_guard<mutex> lock(poolMutex);
+      job = &f;
+      jobBegin = begin;
+      jobEnd = end;
+      jobGrain = g;
+      nextChunk = 0;
+      active = workers.size();
+      error = exception_ptr();
+      generation++;
+    }
+    startCv.notify_all();
+
+    // the calling thread works on the job too
+    inWorker() = true;
+    runChunks();
+    inWorker() = false;
+
+    unique_lock<mutex> lock(poolMutex);
+    while (active > 0) {
+      doneCv.wait(lock);
+    }
+    job = 0;
+
+    if (error)
+      rethrow_exception(error);
+  }
+};
+
+/* Run f(lo, hi) over chunks of [begin, end) on the shared thread pool. */
+template <typename F>
+void parallelFor(const int begin, const int end, const int grain,
+                 const F &f) {
+  ThreadPool::instance().parallelFor(begin, end, grain, f);
+}
+
+#endif // _THREADPOOL_H_
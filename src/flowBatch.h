@@ -0,0 +1,136 @@
+#ifndef _FLOW_BATCH_H_
+#define _FLOW_BATCH_H_
+
+#include <vector>
+
+#include "Exception.h"
+#include "FlowField.h"
+#include "Image.h"
+#include "ThreadPool.h"
+#include "motionTiles.h"
+#include "opticalFlow.h"
+
+using namespace std;
+
+// frame pairs per thread held in memory at a time by a batch
+const int BATCH_PAIRS_PER_THREAD = 2;
+
+/* Working buffers of computeOpticalFlow_Batch() for one round of pairs:
+   the pyramid of every frame and the LK scratch, tile masks and changed
+   tiles of every pair slot.  Kept by the caller from one batch to the
+   next, batches of frames of the same size allocate no memory. */
+struct BatchScratch_t {
+  vector<FramePyramid_t> pyramids;        // frame f0 + j of the round
+  vector<HLKLevels_t> levels;             // LK scratch of pair slot j
+  vector<TileMask_t> masks;               // active tiles of pair slot j
+  vector<vector<unsigned char> > changed; // changed tiles of pair slot j
+};
+
+/* Hierarchical Lucas and Kanade optical flow of every consecutive pair of
+   the numFrames brightness frames, flow[i] from frame i to frame i + 1.
+
+   The pairs are independent, so they run concurrently with one pair per
+   thread.  Threads take the next pair as they finish one, so a thread that
+   draws cheap pairs keeps taking work from the others, and every pair is
+   computed serially on its thread, so the flow is identical to computing
+   the pairs one at a time.  The pairs are processed in rounds of a few per
+   thread, and the pyramid and derivatives of every frame are built once,
+   in parallel, and used by both pairs the frame belongs to (the last frame
+   of a round is kept for the next), so memory is bounded by the round.
+   Every pair slot of a round keeps its LK scratch and tile masks from one
+   round to the next, as FlowStream does between frames, and a scratch
+   given by the caller keeps them from one batch to the next too.  Fields
+   already in flow, tiles and stats are reused for the output.
+
+   With params.motionGate only the tiles that changed in each pair are
+   solved.  If given, tiles and stats return the active tiles and the
+   statistics of every pair.  params.warmStart is not used, since it makes
+   each pair depend on the previous one. */
+void computeOpticalFlow_Batch(const Image<float> *frames, const int numFrames,
+                              const int &winSize, vector<FlowField> *flow,
+                              const FlowParams_t &params = FlowParams_t(),
+                              vector<TileMask_t> *tiles = 0,
+                              vector<FlowStats_t> *stats = 0,
+                              BatchScratch_t *work = 0) {
+  int numPairs = max(numFrames - 1, 0);
+
+  // every pair overwrites its output
+  flow->resize(numPairs);
+  if (tiles)
+    tiles->resize(numPairs);
+  if (stats)
+    stats->resize(numPairs);
+
+  if (numPairs == 0)
+    return;
+
+  int height = frames[0].height();
+  int width = frames[0].width();
+  for (int i = 1; i < numFrames; i++) {
+    if (frames[i].height() != height || frames[i].width() != width)
+      throw Exception("frame dimensions changed within a flow batch");
+  }
+
+  int numLevels = pyramidLevels(params, height, width);
+  int roundPairs =
+      BATCH_PAIRS_PER_THREAD * ThreadPool::instance().numThreads();
+
+  // pyramids[j] belongs to frame f0 + j of the current round, and the
+  // scratch, masks and changed tiles of slot j to pair f0 + j
+  BatchScratch_t local;
+  BatchScratch_t &ws = work ? *work : local;
+  ws.pyramids.resize(roundPairs + 1);
+  ws.levels.resize(roundPairs);
+  ws.masks.resize(roundPairs);
+  ws.changed.resize(roundPairs);
+  vector<FramePyramid_t> &pyramids = ws.pyramids;
+
+  for (int f0 = 0; f0 < numPairs; f0 += roundPairs) {
+    int n = min(roundPairs, numPairs - f0);
+
+    // the last frame of the previous round is the first of this one
+    int first = 1;
+    if (f0 == 0) {
+      first = 0;
+    } else {
+      pyramids[0].levels.swap(pyramids[roundPairs].levels);
+      pyramids[0].derivs.swap(pyramids[roundPairs].derivs);
+    }
+
+    // pyramids of the new frames
+    parallelFor(first, n + 1, 1, [&](int j0, int j1) {
+      for (int j = j0; j < j1; j++) {
+        buildFramePyramid(&frames[f0 + j], numLevels, &pyramids[j]);
+      }
+    });
+
+    // flow of the frame pairs
+    parallelFor(0, n, 1, [&](int j0, int j1) {
+      for (int j = j0; j < j1; j++) {
+        int i = f0 + j;
+        const FramePyramid_t *pp = &pyramids[j];
+        const FramePyramid_t *cp = &pyramids[j + 1];
+        TileMask_t &mask = ws.masks[j];
+
+        // change detection on the finest levels
+        if (params.motionGate) {
+          detectMotionTiles(&pp->levels[0], &cp->levels[0],
+                            params.motionThreshold, params.motionTileSize,
+                            &mask, &ws.changed[j]);
+        } else {
+          mask.init(height, width, params.motionTileSize);
+        }
+
+        computeOpticalFlow_HLK(pp, cp, 0, 0, winSize, &(*flow)[i].u(),
+                               &(*flow)[i].v(), params,
+                               params.motionGate ? &mask : 0,
+                               stats ? &(*stats)[i] : 0, &ws.levels[j]);
+
+        if (tiles)
+          (*tiles)[i] = mask;
+      }
+    });
+  }
+}
+
+#endif // _FLOW_BATCH_H_
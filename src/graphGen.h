@@ -3,6 +3,7 @@
 
 #include "Edge.h"
 #include "Image.h"
+#include "motionTiles.h"
 
 /* Function for computing the distance between two pixels. */
 inline double euclidDiff(const Image<float> *im, const int p0, const int p1) {
@@ -56,4 +57,51 @@ void createGraph(const Image<float> *im, vector<Edge_t> &edgeVec) {
   }
 }
 
+/* Create the graph of an image whose static tiles (see detectMotionTiles())
+   hold the same value at every pixel, e.g. a flow magnitude that is zero
+   there.  Edges inside a static tile all have the same weight, so only a
+   spanning tree of them is created (right edges and down edges of the first
+   column of the tile), which merges the tile into one set in the same way
+   as the complete graph with far fewer edges to sort.  Edges that cross a
+   tile border are always created.  edgeVec is resized to the edges made. */
+void createGraph(const Image<float> *im, const TileMask_t *tiles,
+                 vector<Edge_t> &edgeVec) {
+  int height = im->height();
+  int width = im->width();
+  int ts = tiles->tileSize;
+
+  edgeVec.clear();
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int p0 = h * width + w;
+      bool stat = !tiles->isActive(h, w);
+
+      // neighbours of the complete graph
+      int nh[4] = {h, h + 1, h + 1, h - 1};
+      int nw[4] = {w + 1, w, w + 1, w + 1};
+
+      for (int k = 0; k < 4; k++) {
+        if (nh[k] < 0 || nh[k] >= height || nw[k] >= width)
+          continue;
+
+        bool sameTile = nh[k] / ts == h / ts && nw[k] / ts == w / ts;
+        if (stat && sameTile) {
+          // spanning tree of the static tile
+          bool right = (k == 0);
+          bool down = (k == 1 && w % ts == 0);
+          if (!right && !down)
+            continue;
+        }
+
+        Edge_t e;
+        e.p0 = p0;
+        e.p1 = nh[k] * width + nw[k];
+        e.w = euclidDiff(im, p0, e.p1);
+        edgeVec.push_back(e);
+      }
+    }
+  }
+}
+
 #endif // _GRAPHGEN_H_
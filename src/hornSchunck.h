@@ -0,0 +1,342 @@
+#ifndef _HORNSCHUNCK_H_
+#define _HORNSCHUNCK_H_
+
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+#include "Exception.h"
+#include "Image.h"
+#include "opticalFlow.h"
+
+// Gauss-Seidel sweeps before and after each coarse grid correction
+const int MG_PRE_SWEEPS = 2;
+const int MG_POST_SWEEPS = 2;
+
+// sweeps used to solve the coarsest multigrid level
+const int MG_COARSE_SWEEPS = 10;
+
+// smallest dimension of a multigrid level
+const int MG_MIN_SIZE = 8;
+
+/* The Horn and Schunck system at one level of the multigrid hierarchy.  At
+   every pixel
+
+     (a2 + j11) u + j12 v - a2 avg(u) = f1
+     j12 u + (a2 + j22) v - a2 avg(v) = f2
+
+   where avg() is the lap_33 weighted average of the 8 neighbours.  On the
+   finest level j11 = ex * ex, j12 = ex * ey, j22 = ey * ey, f1 = -ex * et,
+   f2 = -ey * et with et = cImg - pImg and a2 = alpha * alpha, which is the
+   system the Jacobi iteration of computeOpticalFlow_HS converges to.
+   Coarser levels hold the error equation of the level above. */
+struct HSLevel_t {
+  Image<float> j11, j12, j22; // data term coefficients
+  Image<float> f1, f2;        // right hand side
+  Image<float> u, v;          // unknowns
+  Image<float> r1, r2;        // residuals
+  vector<double> rowSum;      // squared residual of each row
+  float a2;                   // regularization weight
+};
+
+/* lap_33 weighted average of the 8 neighbours of (h, w), where neighbours
+   outside the image are zero (the same as convolve() with lap_33). */
+inline float neighbourAverage(const float *u, const int h, const int w,
+                              const int height, const int width) {
+  const float *p = u + h * width + w;
+
+  if (h > 0 && w > 0 && h < height - 1 && w < width - 1) {
+    return (lap_33[0] * (p[-width - 1] + p[-width + 1] + p[width - 1] +
+                         p[width + 1]) +
+            lap_33[1] * (p[-width] + p[-1] + p[1] + p[width]));
+  }
+
+  float s = 0.0;
+  for (int i = -1; i <= 1; i++) {
+    for (int j = -1; j <= 1; j++) {
+      int hp = h + i;
+      int wp = w + j;
+      if (hp >= 0 && hp < height && wp >= 0 && wp < width) {
+        s += lap_33[(i + 1) * 3 + j + 1] * u[hp * width + wp];
+      }
+    }
+  }
+
+  return (s);
+}
+
+/* One in-place SOR sweep over a level.  Pixels are visited in four colours
+   by (h % 2, w % 2); pixels of one colour are never neighbours in the 9
+   point stencil (which is why plain red-black ordering is not enough here),
+   so every colour uses the values just updated by the previous colours and
+   the result does not depend on the visiting order within a colour.  At
+   each pixel the coupled 2x2 system for (u, v) is solved exactly and the
+   step towards it is scaled by omega. */
+void sweepHS(HSLevel_t *l, const float &omega) {
+  static const int colours[4][2] = {{0, 0}, {1, 1}, {0, 1}, {1, 0}};
+  int height = l->u.height();
+  int width = l->u.width();
+  float *u = &l->u[0];
+  float *v = &l->v[0];
+  float a2 = l->a2;
+
+  for (int c = 0; c < 4; c++) {
+    // rows of this colour are independent
+    int numRows = (height - colours[c][0] + 1) / 2;
+    parallelFor(0, numRows, PARALLEL_ROWS, [&](int r0, int r1) {
+      for (int h = colours[c][0] + 2 * r0; h < colours[c][0] + 2 * r1;
+           h += 2) {
+        for (int w = colours[c][1]; w < width; w += 2) {
+          int ind = h * width + w;
+
+          // right hand side with the current neighbours
+          float b1 =
+              l->f1[ind] + a2 * neighbourAverage(u, h, w, height, width);
+          float b2 =
+              l->f2[ind] + a2 * neighbourAverage(v, h, w, height, width);
+
+          // solve the 2x2 system at this pixel
+          float m11 = a2 + l->j11[ind];
+          float m22 = a2 + l->j22[ind];
+          float m12 = l->j12[ind];
+          float d = 1.0 / (m11 * m22 - m12 * m12);
+
+          float us = (m22 * b1 - m12 * b2) * d;
+          float vs = (m11 * b2 - m12 * b1) * d;
+
+          // over-relax towards the solution
+          u[ind] += omega * (us - u[ind]);
+          v[ind] += omega * (vs - v[ind]);
+        }
+      }
+    });
+  }
+}
+
+/* Compute the residuals r1, r2 of a level and return their RMS value. */
+double residualHS(HSLevel_t *l) {
+  int height = l->u.height();
+  int width = l->u.width();
+  const float *u = &l->u[0];
+  const float *v = &l->v[0];
+  float a2 = l->a2;
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      double s = 0.0;
+
+      for (int w = 0; w < width; w++) {
+        int ind = h * width + w;
+        float au = neighbourAverage(u, h, w, height, width);
+        float av = neighbourAverage(v, h, w, height, width);
+
+        float r1 = l->f1[ind] - ((a2 + l->j11[ind]) * u[ind] +
+                                 l->j12[ind] * v[ind] - a2 * au);
+        float r2 = l->f2[ind] - (l->j12[ind] * u[ind] +
+                                 (a2 + l->j22[ind]) * v[ind] - a2 * av);
+
+        l->r1[ind] = r1;
+        l->r2[ind] = r2;
+        s += r1 * r1 + r2 * r2;
+      }
+
+      l->rowSum[h] = s;
+    }
+  });
+
+  // add the row sums in order so the result does not depend on threading
+  double s = 0.0;
+  for (int h = 0; h < height; h++) {
+    s += l->rowSum[h];
+  }
+
+  return (sqrt(s / (2.0 * height * width)));
+}
+
+/* Average each 2x2 block of the fine image into the coarse image. */
+void restrictHS(const Image<float> *fine, Image<float> *coarse) {
+  int fh = fine->height();
+  int fw = fine->width();
+
+  parallelFor(0, coarse->height(), PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < coarse->width(); w++) {
+        float s = 0.0;
+        int n = 0;
+
+        for (int i = 2 * h; i < 2 * h + 2 && i < fh; i++) {
+          for (int j = 2 * w; j < 2 * w + 2 && j < fw; j++) {
+            s += fine->getPixel(i * fw + j);
+            n++;
+          }
+        }
+
+        coarse->setPixel(h * coarse->width() + w, s / n);
+      }
+    }
+  });
+}
+
+/* Add the bilinear interpolation of the coarse correction to the fine
+   image.  Pixel centers are aligned with the 2x2 blocks of restrictHS(). */
+void prolongateHS(const Image<float> *coarse, Image<float> *fine) {
+  int ch = coarse->height();
+  int cw = coarse->width();
+
+  parallelFor(0, fine->height(), PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      float hc = min(max(h / 2.0 - 0.25, 0.0), ch - 1.0);
+
+      for (int w = 0; w < fine->width(); w++) {
+        float wc = min(max(w / 2.0 - 0.25, 0.0), cw - 1.0);
+        int ind = h * fine->width() + w;
+
+        fine->setPixel(ind, fine->getPixel(ind) + coarse->bilinear(hc, wc));
+      }
+    }
+  });
+}
+
+/* One multigrid V-cycle starting at level l.  Smoothing uses Gauss-Seidel
+   sweeps (omega = 1), which damp high frequencies better than over-relaxed
+   sweeps. */
+void vcycleHS(vector<HSLevel_t> &levels, const unsigned l) {
+  HSLevel_t &fine = levels[l];
+
+  // solve the coarsest level by relaxation
+  if (l == levels.size() - 1) {
+    for (int i = 0; i < MG_COARSE_SWEEPS; i++) {
+      sweepHS(&fine, 1.0);
+    }
+    return;
+  }
+
+  for (int i = 0; i < MG_PRE_SWEEPS; i++) {
+    sweepHS(&fine, 1.0);
+  }
+
+  // error equation on the next coarser level
+  HSLevel_t &coarse = levels[l + 1];
+  residualHS(&fine);
+  restrictHS(&fine.r1, &coarse.f1);
+  restrictHS(&fine.r2, &coarse.f2);
+  coarse.u.fill(0.0);
+  coarse.v.fill(0.0);
+
+  vcycleHS(levels, l + 1);
+
+  // apply coarse grid correction
+  prolongateHS(&coarse.u, &fine.u);
+  prolongateHS(&coarse.v, &fine.v);
+
+  for (int i = 0; i < MG_POST_SWEEPS; i++) {
+    sweepHS(&fine, 1.0);
+  }
+}
+
+/* Horn and Schunck optical flow solved in place with SOR sweeps of
+   params.sorOmega, or with multigrid V-cycles when params.sorLevels > 1,
+   whose Gauss-Seidel smoother does not use params.sorOmega.  Iteration
+   stops when the RMS residual drops below params.sorTolerance times the
+   initial residual or after params.sorMaxIters sweeps (V-cycles).  With
+   very weak or strong smoothing the float residual can level off near 2e-6
+   while the smooth error components are still shrinking, so a tight
+   tolerance may run all params.sorMaxIters.  If flow has the size of the
+   images it is used as the initial estimate, otherwise the estimate starts
+   at zero.  The planes of flow are solved in place, and all memory is
+   allocated before the first sweep.  Returns the number of sweeps
+   (V-cycles) performed, negated if the residual did not drop below the
+   tolerance within params.sorMaxIters, in which case flow holds the last
+   estimate. */
+int computeOpticalFlow_HSSOR(const Image<float> *pImg,
+                             const Image<float> *cImg, const double &alpha,
+                             FlowField *flow,
+                             const FlowParams_t &params = FlowParams_t()) {
+  int height = pImg->height();
+  int width = pImg->width();
+
+  if (alpha <= 0.0) {
+    throw Exception("Horn and Schunck requires a positive alpha");
+  }
+
+  // compute derivatives for this frame
+  Image<float> dx, dy, dt;
+  computeDerivatives(pImg, cImg, &dx, &dy, &dt);
+
+  // number of levels that fit the image
+  int numLevels = 1;
+  for (int hp = height, wp = width; numLevels < params.sorLevels; numLevels++) {
+    hp = (hp + 1) / 2;
+    wp = (wp + 1) / 2;
+    if (hp < MG_MIN_SIZE || wp < MG_MIN_SIZE)
+      break;
+  }
+
+  // finest level holds the flow field
+  vector<HSLevel_t> levels(numLevels);
+  HSLevel_t &l0 = levels[0];
+  l0.j11 = dx * dx;
+  l0.j12 = dx * dy;
+  l0.j22 = dy * dy;
+  l0.f1 = dx * dt; // dt is pImg - cImg, so -ex * et = dx * dt
+  l0.f2 = dy * dt;
+  l0.a2 = alpha * alpha;
+  l0.r1.init(height, width);
+  l0.r2.init(height, width);
+  l0.rowSum.resize(height);
+
+  // the finest level works on the planes of flow
+  if (!flow->hasSize(height, width))
+    flow->init(height, width);
+  l0.u = move(flow->u());
+  l0.v = move(flow->v());
+
+  // coarser levels hold the error equations
+  for (int l = 1; l < numLevels; l++) {
+    HSLevel_t &fine = levels[l - 1];
+    HSLevel_t &coarse = levels[l];
+    int hp = (fine.u.height() + 1) / 2;
+    int wp = (fine.u.width() + 1) / 2;
+
+    coarse.j11.init(hp, wp);
+    coarse.j12.init(hp, wp);
+    coarse.j22.init(hp, wp);
+    restrictHS(&fine.j11, &coarse.j11);
+    restrictHS(&fine.j12, &coarse.j12);
+    restrictHS(&fine.j22, &coarse.j22);
+
+    // the smoothness term of a twice as coarse grid is weighted by 1/4
+    coarse.a2 = fine.a2 / 4.0;
+
+    coarse.f1.init(hp, wp);
+    coarse.f2.init(hp, wp);
+    coarse.u.init(hp, wp);
+    coarse.v.init(hp, wp);
+    coarse.r1.init(hp, wp);
+    coarse.r2.init(hp, wp);
+    coarse.rowSum.resize(hp);
+  }
+
+  // iterate until the residual has dropped enough
+  double r0 = residualHS(&l0);
+  bool converged = (r0 == 0.0);
+  int iter = 0;
+  while (!converged && iter < params.sorMaxIters) {
+    if (numLevels > 1) {
+      vcycleHS(levels, 0);
+    } else {
+      sweepHS(&l0, params.sorOmega);
+    }
+    iter++;
+
+    converged = (residualHS(&l0) <= params.sorTolerance * r0);
+  }
+
+  flow->u() = move(l0.u);
+  flow->v() = move(l0.v);
+
+  return (converged ? iter : -iter);
+}
+
+#endif // _HORNSCHUNCK_H_
@@ -0,0 +1,135 @@
+#ifndef _MOTION_TILES_H_
+#define _MOTION_TILES_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "Image.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// default tile size in full resolution pixels for change detection
+const int MOTION_TILE_SIZE = 32;
+
+// number of changed pixels that make a tile active
+const int MOTION_MIN_PIXELS = 4;
+
+/* Grid of square tiles over a frame marking which tiles changed between two
+   frames (active) and which are static.  The mask is addressed with the
+   pixel coordinates of pyramid level 'level', where a pixel (h, w) covers
+   full resolution pixel (h << level, w << level). */
+struct TileMask_t {
+  int tileSize;                 // tile size in full resolution pixels
+  int rows, cols;               // number of tiles
+  int level;                    // pyramid level of the pixel coordinates
+  vector<unsigned char> active; // 1 if the tile is active, row major
+
+  TileMask_t() : tileSize(MOTION_TILE_SIZE), rows(0), cols(0), level(0) {}
+
+  // tiles covering a height x width frame, all active
+  void init(const int height, const int width, const int ts) {
+    tileSize = max(ts, 1);
+    rows = (height + tileSize - 1) / tileSize;
+    cols = (width + tileSize - 1) / tileSize;
+    level = 0;
+    active.assign(rows * cols, 1);
+  }
+
+  // the same mask addressed with the pixels of pyramid level l
+  TileMask_t atLevel(const int l) const {
+    TileMask_t t = *this;
+    t.level = l;
+    return (t);
+  }
+
+  bool isActive(const int h, const int w) const {
+    int r = min((h << level) / tileSize, rows - 1);
+    int c = min((w << level) / tileSize, cols - 1);
+    return (active[r * cols + c] != 0);
+  }
+
+  // true if any tile touching pixel rows [h0, h1) is active
+  bool rowsActive(const int h0, const int h1) const {
+    int r0 = min((h0 << level) / tileSize, rows - 1);
+    int r1 = min(((h1 - 1) << level) / tileSize, rows - 1);
+
+    for (int i = r0 * cols; i < (r1 + 1) * cols; i++) {
+      if (active[i])
+        return (true);
+    }
+    return (false);
+  }
+
+  int numActive() const {
+    int n = 0;
+    for (unsigned i = 0; i < active.size(); i++) {
+      n += active[i];
+    }
+    return (n);
+  }
+
+  // mark the tiles active in either mask (same grid) as active
+  void merge(const TileMask_t &o) {
+    for (unsigned i = 0; i < active.size(); i++) {
+      active[i] |= o.active[i];
+    }
+  }
+};
+
+/* Change detection between the blurred brightness images pImg and cImg.  A
+   tile is active if at least MOTION_MIN_PIXELS of its pixels differ by more
+   than threshold.  The active tiles are grown by one tile in every
+   direction, since moving content crosses tile borders and the flow windows
+   and pyramid filters reach into neighbouring tiles.  The changed tiles are
+   kept in scratch if given. */
+void detectMotionTiles(const Image<float> *pImg, const Image<float> *cImg,
+                       const float &threshold, const int tileSize,
+                       TileMask_t *tiles,
+                       vector<unsigned char> *scratch = 0) {
+  int height = pImg->height();
+  int width = pImg->width();
+
+  tiles->init(height, width, tileSize);
+  vector<unsigned char> local;
+  vector<unsigned char> &changed = scratch ? *scratch : local;
+  changed.assign(tiles->rows * tiles->cols, 0);
+
+  parallelFor(0, tiles->rows, 1, [&](int r0, int r1) {
+    for (int r = r0; r < r1; r++) {
+      int h0 = r * tiles->tileSize;
+      int h1 = min(h0 + tiles->tileSize, height);
+
+      for (int c = 0; c < tiles->cols; c++) {
+        int w0 = c * tiles->tileSize;
+        int w1 = min(w0 + tiles->tileSize, width);
+        int n = 0;
+
+        for (int h = h0; h < h1 && n < MOTION_MIN_PIXELS; h++) {
+          for (int w = w0; w < w1; w++) {
+            int ind = h * width + w;
+            if (fabs(pImg->getPixel(ind) - cImg->getPixel(ind)) > threshold)
+              n++;
+          }
+        }
+
+        changed[r * tiles->cols + c] = (n >= MOTION_MIN_PIXELS);
+      }
+    }
+  });
+
+  // grow the changed tiles by one tile
+  for (int r = 0; r < tiles->rows; r++) {
+    for (int c = 0; c < tiles->cols; c++) {
+      unsigned char a = 0;
+      for (int i = max(r - 1, 0); i <= min(r + 1, tiles->rows - 1); i++) {
+        for (int j = max(c - 1, 0); j <= min(c + 1, tiles->cols - 1); j++) {
+          a |= changed[i * tiles->cols + j];
+        }
+      }
+      tiles->active[r * tiles->cols + c] = a;
+    }
+  }
+}
+
+#endif // _MOTION_TILES_H_
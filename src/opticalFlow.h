@@ -1,13 +1,181 @@
 #ifndef _OPTICAL_FLOW_H_
 #define _OPTICAL_FLOW_H_
 
+#include <atomic>
+
+#include "FlowField.h"
 #include "Image.h"
+#include "PaddedImage.h"
+#include "StructureTensor.h"
+#include "motionTiles.h"
+
+// FlowParams_t::numLevels value that chooses the pyramid depth of every
+// frame pair from its motion
+const int ADAPTIVE_LEVELS = 0;
+
+// smallest dimension of the coarsest pyramid level
+const int MIN_LEVEL_SIZE = 64;
+
+// largest displacement in pixels that LK resolves at a single level
+const float LK_LEVEL_RANGE = 1.0;
+
+// fraction of the pixels whose motion the adaptive depth must cover
+const float ADAPTIVE_PERCENTILE = 0.9;
+
+// approximate working set of hierarchical LK in bytes per input pixel: the
+// pyramids and derivatives of both frames, the flow and its upsampled copy
+// at each level and the input crops of a tile
+const int HLK_BYTES_PER_PIXEL = 96;
+
+// reach of the pyramid filter and the 2x2 derivatives in pixels of a level
+const int PYRAMID_FILTER_RADIUS = 3;
+
+/* Run time options for the optical flow estimators. */
+struct FlowParams_t {
+  // number of gaussian pyramid levels (ADAPTIVE_LEVELS to choose it per
+  // frame pair from a coarse motion estimate, up to maxLevels and clamped by
+  // the frame size) and number of Horn and Schunck iterations
+  int numLevels;
+  int maxLevels;
+  int numIters;
+
+  // warp the cImg derivatives by the estimate from the coarser level once per
+  // level (bilinear) instead of gathering a displaced window for every pixel
+  bool warpOnce;
+
+  // Horn and Schunck SOR solver: relaxation factor of plain SOR (multigrid
+  // smooths with Gauss-Seidel, omega = 1, and ignores it), maximum number
+  // of sweeps (V-cycles when sorLevels > 1), residual relative to the
+  // initial residual at which to stop, and number of multigrid levels (1
+  // for plain SOR, which may need several hundred sweeps where a few
+  // V-cycles suffice).  The residual falls much faster than the error of
+  // the smooth flow components, so the tolerance is tight: 1e-3 stops
+  // multigrid about 0.1 pixels from the converged flow, 1e-6 within 5e-4
+  float sorOmega;
+  int sorMaxIters;
+  float sorTolerance;
+  int sorLevels;
+
+  // seed hierarchical LK with the flow of the previous frame pair, starting
+  // at pyramid level warmStartLevel (0 is full resolution) instead of the
+  // coarsest level
+  bool warmStart;
+  int warmStartLevel;
+
+  // fall back to a cold start when the mean absolute frame difference
+  // relative to the mean intensity exceeds this (a scene change)
+  float sceneChangeThreshold;
+
+  // skip the tiles that did not change between the frames (see
+  // detectMotionTiles()), where a pixel changed if it differs by more than
+  // motionThreshold; the flow of static tiles is zero
+  bool motionGate;
+  int motionTileSize;
+  float motionThreshold;
 
-// number of iterations for Horn and Schunk algorithm
-const int NUM_ITERS = 20;
+  // hierarchical LK does not solve the pixels of a finer level whose 3x3
+  // neighbourhood was ill conditioned (textureless) at the coarser level,
+  // but passes the coarser estimate through
+  bool textureSkip;
 
-// number of levels for gaussian pyramid
-const int NUM_LEVELS = 3;
+  // forward-backward consistency: a pixel is occluded if the forward flow
+  // and the backward flow at its target differ by more than
+  // fbAlpha * (|forward|^2 + |backward|^2) + fbBeta (squared pixels)
+  float fbAlpha;
+  float fbBeta;
+
+  // tiled hierarchical LK: working set budget in bytes and the largest
+  // expected motion in pixels, which is added to the tile halo
+  long tileMemoryBudget;
+  int tileMotionMargin;
+
+  // dense inverse search: patch size and spacing in pixels, inverse
+  // compositional iterations per patch and the finest pyramid level
+  // searched (the flow is interpolated up to full resolution from there),
+  // see setDISQuality()
+  int disPatchSize;
+  int disPatchStride;
+  int disIters;
+  int disFinestLevel;
+
+  FlowParams_t()
+      : numLevels(3), maxLevels(6), numIters(20), warpOnce(false),
+        sorOmega(1.8), sorMaxIters(200), sorTolerance(1e-6), sorLevels(4),
+        warmStart(false), warmStartLevel(1),
+        sceneChangeThreshold(0.25), motionGate(false),
+        motionTileSize(MOTION_TILE_SIZE), motionThreshold(4.0),
+        textureSkip(false), fbAlpha(0.01), fbBeta(0.5),
+        tileMemoryBudget(64L << 20), tileMotionMargin(8),
+        disPatchSize(8), disPatchStride(4), disIters(12), disFinestLevel(1) {}
+};
+
+// dense inverse search speed and quality settings, fastest first
+enum { DIS_ULTRAFAST = 0, DIS_FAST, DIS_MEDIUM, DIS_HIGH };
+
+/* Set the dense inverse search options from one of the DIS_* settings,
+   which trade accuracy for speed. */
+void setDISQuality(const int quality, FlowParams_t *params) {
+  switch (quality) {
+  case DIS_ULTRAFAST:
+    params->disPatchSize = 8;
+    params->disPatchStride = 5;
+    params->disIters = 8;
+    params->disFinestLevel = 2;
+    break;
+  case DIS_FAST:
+    params->disPatchSize = 8;
+    params->disPatchStride = 4;
+    params->disIters = 12;
+    params->disFinestLevel = 1;
+    break;
+  case DIS_MEDIUM:
+    params->disPatchSize = 12;
+    params->disPatchStride = 4;
+    params->disIters = 16;
+    params->disFinestLevel = 1;
+    break;
+  case DIS_HIGH:
+    params->disPatchSize = 12;
+    params->disPatchStride = 3;
+    params->disIters = 16;
+    params->disFinestLevel = 0;
+    break;
+  default:
+    throw Exception("unknown dense inverse search quality");
+  }
+}
+
+/* Derivatives of one image: dx and dy with kx_22 and ky_22 and dt with
+   kt_22.  The temporal derivative of an image pair is pImg dt - cImg dt. */
+struct ImageDerivatives_t {
+  Image<float> dx, dy, dt;
+};
+
+/* Texture masks of the LK solve at one pyramid level.  Pixels set in skip
+   are neither accumulated nor solved and their estimate is passed through;
+   every pixel that is skipped or found ill conditioned is set in
+   lowTexture, which gives the skip mask of the next finer level. */
+struct TextureMask_t {
+  const Image<unsigned char> *skip; // pixels to skip, or null
+  Image<unsigned char> lowTexture;  // skipped or ill conditioned pixels
+  atomic<long> skipped;             // number of pixels skipped
+
+  TextureMask_t() : skip(0), skipped(0) {}
+};
+
+/* Statistics of one hierarchical LK estimate, by pyramid level (finest
+   first).  Levels that were not solved count zero. */
+struct FlowStats_t {
+  vector<long> skipped;    // pixels skipped as textureless
+  vector<long> lowTexture; // pixels skipped or found ill conditioned
+};
+
+/* Gaussian pyramid of one frame and the derivatives of every level, which
+   is everything hierarchical LK needs from a frame. */
+struct FramePyramid_t {
+  vector<Image<float> > levels;      // pyramid levels, finest first
+  vector<ImageDerivatives_t> derivs; // derivatives of each level
+};
 
 // kernels for computer derviatives in x,y,t dims.
 const float kx_22[4] = {-0.25, 0.25, -0.25, 0.25};
@@ -22,211 +190,457 @@ const float nkt_22[4] = {-0.25, -0.25, -0.25, -0.25};
 const float lap_33[9] = {1.0 / 12.0, 1.0 / 6.0,  1.0 / 12.0, 1.0 / 6.0, 0.0,
                          1.0 / 6.0,  1.0 / 12.0, 1.0 / 6.0,  1.0 / 12.0};
 
+/* Apply a 2x2 derivative kernel to the samples a = (h, w), b = (h, w + 1),
+   c = (h + 1, w) and e = (h + 1, w + 1).  The taps are summed in the same
+   order as convolve() so results are identical. */
+inline float apply22(const float *k, const float a, const float b,
+                     const float c, const float e) {
+  float d = 0.0;
+  d += a * k[0];
+  d += b * k[1];
+  d += c * k[2];
+  d += e * k[3];
+  return (d);
+}
+
+/* Bilinear sample of img at (h, w), clamped to the image. */
+inline float sampleClamped(const Image<float> *img, float h, float w) {
+  h = min(max(h, (float)0.0), (float)(img->height() - 1));
+  w = min(max(w, (float)0.0), (float)(img->width() - 1));
+  return (img->bilinear(h, w));
+}
+
+/* Compute the x, y and t derivatives of a single image with the kx_22,
+   ky_22 and kt (kt_22 or nkt_22) kernels in one pass.  This is the same as
+   copying the image three times and calling convolve() on each copy, where
+   samples beyond the last row and column are zero. */
+void computeDerivatives(const Image<float> *img, const float *kt,
+                        Image<float> *dx, Image<float> *dy, Image<float> *dt) {
+  int height = img->height();
+  int width = img->width();
+  Image<float> zeroRow(1, width); // stands in for the row below the last
+
+  dx->init(height, width);
+  dy->init(height, width);
+  dt->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      const float *r0 = &(*img)[h * width];
+      const float *r1 =
+          (h < height - 1) ? &(*img)[(h + 1) * width] : &zeroRow[0];
+      float *ox = &(*dx)[h * width];
+      float *oy = &(*dy)[h * width];
+      float *ot = &(*dt)[h * width];
+
+      // all four samples inside the row pair
+      for (int w = 0; w < width - 1; w++) {
+        ox[w] = apply22(kx_22, r0[w], r0[w + 1], r1[w], r1[w + 1]);
+        oy[w] = apply22(ky_22, r0[w], r0[w + 1], r1[w], r1[w + 1]);
+        ot[w] = apply22(kt, r0[w], r0[w + 1], r1[w], r1[w + 1]);
+      }
+
+      // last column
+      int w = width - 1;
+      ox[w] = apply22(kx_22, r0[w], 0.0, r1[w], 0.0);
+      oy[w] = apply22(ky_22, r0[w], 0.0, r1[w], 0.0);
+      ot[w] = apply22(kt, r0[w], 0.0, r1[w], 0.0);
+    }
+  });
+}
+
+/* Compute the summed derivatives of pImg and cImg (kt_22 for pImg and
+   nkt_22 for cImg in time) in one pass over both images, without the
+   intermediate per-image derivative images. */
+void computeDerivatives(const Image<float> *pImg, const Image<float> *cImg,
+                        Image<float> *dx, Image<float> *dy, Image<float> *dt) {
+  int height = pImg->height();
+  int width = pImg->width();
+  Image<float> zeroRow(1, width); // stands in for the row below the last
+
+  dx->init(height, width);
+  dy->init(height, width);
+  dt->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      const float *p0 = &(*pImg)[h * width];
+      const float *c0 = &(*cImg)[h * width];
+      const float *p1 =
+          (h < height - 1) ? &(*pImg)[(h + 1) * width] : &zeroRow[0];
+      const float *c1 =
+          (h < height - 1) ? &(*cImg)[(h + 1) * width] : &zeroRow[0];
+      float *ox = &(*dx)[h * width];
+      float *oy = &(*dy)[h * width];
+      float *ot = &(*dt)[h * width];
+
+      // all four samples inside the row pair
+      for (int w = 0; w < width - 1; w++) {
+        ox[w] = apply22(kx_22, p0[w], p0[w + 1], p1[w], p1[w + 1]) +
+                apply22(kx_22, c0[w], c0[w + 1], c1[w], c1[w + 1]);
+        oy[w] = apply22(ky_22, p0[w], p0[w + 1], p1[w], p1[w + 1]) +
+                apply22(ky_22, c0[w], c0[w + 1], c1[w], c1[w + 1]);
+        ot[w] = apply22(kt_22, p0[w], p0[w + 1], p1[w], p1[w + 1]) +
+                apply22(nkt_22, c0[w], c0[w + 1], c1[w], c1[w + 1]);
+      }
+
+      // last column
+      int w = width - 1;
+      ox[w] = apply22(kx_22, p0[w], 0.0, p1[w], 0.0) +
+              apply22(kx_22, c0[w], 0.0, c1[w], 0.0);
+      oy[w] = apply22(ky_22, p0[w], 0.0, p1[w], 0.0) +
+              apply22(ky_22, c0[w], 0.0, c1[w], 0.0);
+      ot[w] = apply22(kt_22, p0[w], 0.0, p1[w], 0.0) +
+              apply22(nkt_22, c0[w], 0.0, c1[w], 0.0);
+    }
+  });
+}
+
+/* Sum the derivatives of an image pair from their per-image derivatives.
+   The result is identical to the single pass computeDerivatives() over
+   pImg and cImg. */
+void sumDerivatives(const ImageDerivatives_t *pd, const ImageDerivatives_t *cd,
+                    Image<float> *dx, Image<float> *dy, Image<float> *dt) {
+  int height = pd->dx.height();
+  int width = pd->dx.width();
+
+  dx->init(height, width);
+  dy->init(height, width);
+  dt->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int i = h0 * width; i < h1 * width; i++) {
+      (*dx)[i] = pd->dx[i] + cd->dx[i];
+      (*dy)[i] = pd->dy[i] + cd->dy[i];
+      (*dt)[i] = pd->dt[i] - cd->dt[i];
+    }
+  });
+}
+
+/* Largest number of pyramid levels, up to maxLevels, for which the coarsest
+   level of a height x width frame is at least MIN_LEVEL_SIZE. */
+int maxPyramidLevels(const int height, const int width, const int maxLevels) {
+  int levels = 1;
+  while (levels < maxLevels &&
+         (min(height, width) >> levels) >= MIN_LEVEL_SIZE) {
+    levels++;
+  }
+  return (levels);
+}
+
+/* Number of pyramid levels to build for a height x width frame: the fixed
+   params.numLevels, or with ADAPTIVE_LEVELS the deepest pyramid the frame
+   allows, of which each pair uses as many levels as its motion needs. */
+int pyramidLevels(const FlowParams_t &params, const int height,
+                  const int width) {
+  if (params.numLevels != ADAPTIVE_LEVELS)
+    return (params.numLevels);
+  return (maxPyramidLevels(height, width, params.maxLevels));
+}
+
+/* Number of pyramid levels, up to maxLevels, needed to resolve the motion
+   (u, v) estimated at pyramid level 'level', where each level resolves
+   LK_LEVEL_RANGE pixels.  The motion is the ADAPTIVE_PERCENTILE of the flow
+   magnitude in full resolution pixels.  The magnitudes are kept in scratch
+   if given, so repeated calls do not allocate. */
+int levelsForMotion(const Image<float> *u, const Image<float> *v,
+                    const int level, const int maxLevels,
+                    vector<float> *scratch = 0) {
+  int n = u->height() * u->width();
+  vector<float> local;
+  vector<float> &mag = scratch ? *scratch : local;
+  mag.resize(n);
+
+  for (int i = 0; i < n; i++) {
+    mag[i] = sqrt(u->getPixel(i) * u->getPixel(i) +
+                  v->getPixel(i) * v->getPixel(i));
+  }
+
+  int k = min((int)(ADAPTIVE_PERCENTILE * n), n - 1);
+  nth_element(mag.begin(), mag.begin() + k, mag.end());
+  float motion = mag[k] * (1 << level);
+
+  int levels = 1;
+  while (levels < maxLevels &&
+         motion > LK_LEVEL_RANGE * (1 << (levels - 1))) {
+    levels++;
+  }
+  return (levels);
+}
+
+/* Build the gaussian pyramid of a frame and the derivatives of each level. */
+void buildFramePyramid(const Image<float> *img, const int numLevels,
+                       FramePyramid_t *fp) {
+  img->pyramid(numLevels, fp->levels);
+
+  fp->derivs.resize(fp->levels.size());
+  for (unsigned l = 0; l < fp->levels.size(); l++) {
+    ImageDerivatives_t &d = fp->derivs[l];
+    computeDerivatives(&fp->levels[l], kt_22, &d.dx, &d.dy, &d.dt);
+  }
+}
+
 /* Horn and Schunck iterative optical flow.  This algorithm assumes the
-   vector field is differentiable. */
+   vector field is differentiable.  pflow holds the initial estimate (zero if
+   it does not have the size of the images) and is overwritten as the work
+   field of the iterations; the result is returned in oflow. */
 void computeOpticalFlow_HS(const Image<float> *pImg, const Image<float> *cImg,
-                           const double &alpha, Image<Vec2f_t> *pflow,
-                           Image<Vec2f_t> *oflow) {
-  float avgu, avgv, ex, ey, et, d;
-  Image<float> t0, t1, *du, *dv;
+                           const double &alpha, FlowField *pflow,
+                           FlowField *oflow,
+                           const FlowParams_t &params = FlowParams_t()) {
+  Image<float> dx, dy, dt;
   int height = pImg->height();
   int width = pImg->width();
-  Vec2f_t vp;
+
+  if (!pflow->hasSize(height, width))
+    pflow->init(height, width);
+  if (!oflow->hasSize(height, width))
+    oflow->init(height, width);
 
   // compute derivatives for this frame
-  t0 = *pImg;
-  t1 = *cImg;               // copy images
-  t0.convolve(kx_22, 2, 2); // compute dx
-  t1.convolve(kx_22, 2, 2); // compute dx
-  Image<float> dx = t0 + t1;
-
-  t0 = *pImg;
-  t1 = *cImg;               // copy images
-  t0.convolve(ky_22, 2, 2); // compute dy
-  t1.convolve(ky_22, 2, 2); // compute dy
-  Image<float> dy = t0 + t1;
-
-  t0 = *pImg;
-  t1 = *cImg;                // copy images
-  t0.convolve(kt_22, 2, 2);  // compute dt
-  t1.convolve(nkt_22, 2, 2); // compute dt
-  Image<float> dt = t0 + t1;
+  computeDerivatives(pImg, cImg, &dx, &dy, &dt);
 
   // loop so answer converges
-  for (int i = 0; i < NUM_ITERS; i++) {
-    // get vector components from previous iteration
-    du = getChannel(pflow, 0);
-    dv = getChannel(pflow, 1);
+  for (int i = 0; i < params.numIters; i++) {
+    // the previous estimate is only read through its local average, so the
+    // laplacian replaces it in place
+    Image<float> &du = pflow->u();
+    Image<float> &dv = pflow->v();
+    du.convolve(lap_33, 3, 3);
+    dv.convolve(lap_33, 3, 3);
 
-    // compute laplacian using local average
-    du->convolve(lap_33, 3, 3);
-    dv->convolve(lap_33, 3, 3);
+    Image<float> &ou = oflow->u();
+    Image<float> &ov = oflow->v();
 
     // compute optical flow field
-    for (int h = 0; h < height; h++) {
-      for (int w = 0; w < width; w++) {
-        int ind = h * width + w; // index into flat pixel array
+    parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+      float avgu, avgv, ex, ey, et, d;
 
-        // index to get values for calculation
-        ex = dx[ind];
-        ey = dy[ind];
-        et = dt[ind];
-        avgu = du->getPixel(ind);
-        avgv = dv->getPixel(ind);
+      for (int h = h0; h < h1; h++) {
+        for (int w = 0; w < width; w++) {
+          int ind = h * width + w; // index into flat pixel array
 
-        // factor d is common to both du and dv estimation
-        d = (ex * avgu + ey * avgv + et) / (alpha * alpha + ex * ex + ey * ey);
+          // index to get values for calculation, the summed time
+          // derivative is pImg - cImg, so it is negated
+          ex = dx[ind];
+          ey = dy[ind];
+          et = -dt[ind];
+          avgu = du[ind];
+          avgv = dv[ind];
 
-        // estimate du, dv as difference between laplacian and current estimate
-        vp[0] = avgu - ex * d;
-        vp[1] = avgv - ey * d;
+          // factor d is common to both du and dv estimation
+          d = (ex * avgu + ey * avgv + et) /
+              (alpha * alpha + ex * ex + ey * ey);
 
-        // update vector estimate
-        oflow->setPixel(ind, vp);
+          // estimate du, dv as difference between laplacian and current
+          // estimate
+          ou[ind] = avgu - ex * d;
+          ov[ind] = avgv - ey * d;
+        }
       }
-    }
+    });
 
-    // free vector component images for next iteration
-    delete du;
-    delete dv;
-
-    if (i < NUM_ITERS - 1) // don't swap on last iteration
+    if (i < params.numIters - 1) // don't swap on last iteration
     {
-      // swap pointers for oflow and pflow for next iteration
-      Image<Vec2f_t> *p = pflow;
-      pflow = oflow;
-      oflow = p;
+      // swap oflow and pflow for next iteration
+      pflow->swap(*oflow);
     }
   }
 }
 
-/* Lucas and Kanade optical flow algorithm.  This algorithm assumes the optical
-   flow is uniform among neighbors. */
-void computeOpticalFlow_LK(const Image<float> *pImg, const Image<float> *cImg,
-                           const Image<float> *u0, const Image<float> *v0,
-                           const int &winSize, Image<float> *u,
-                           Image<float> *v) {
-  int height = pImg->height();
-  int width = pImg->width();
-  Vec2f_t vp;
+/* Accumulate the structure tensor terms for Lucas and Kanade over a window
+   about each pixel of image rows [h0, h1), where the cImg derivatives are
+   sampled at the window displaced by the whole pixel part (floor) of the
+   current estimate (u0, v0) of that pixel.  Samples where either the window
+   pixel or its displacement falls outside the image are treated as zero.
+   The five sums are kept in registers so no memory is allocated.  Pixels in
+   static tiles and pixels set in the texture skip mask are skipped.
 
-  // compute derivatives for pImg
-  Image<float> pImgDx = *pImg;
-  pImgDx.convolve(kx_22, 2, 2); // compute dx
+   WIN is the window size known at compile time, so the window loops unroll,
+   or 0 to use winSize.  Windows that cross the image edge at either end are
+   clipped to the rows and columns inside the image at both ends, so no
+   sample is bounds checked and the sums match the per-sample checks. */
+template <int WIN>
+void accumulateWarpedTensorWin(const ImageDerivatives_t *pd,
+                               const ImageDerivatives_t *cd,
+                               const Image<float> *u0, const Image<float> *v0,
+                               const int &winSize, const int h0, const int h1,
+                               StructureTensor *st, const TileMask_t *tiles,
+                               const TextureMask_t *texture) {
+  const int win = WIN ? WIN : winSize;
+  int height = pd->dx.height();
+  int width = pd->dx.width();
+  int winSize_2 = win / 2;
 
-  Image<float> pImgDy = *pImg;
-  pImgDy.convolve(ky_22, 2, 2); // compute dy
+  for (int h = h0; h < h1; h++) {
+    float *t_dx_2 = st->row(h - h0, StructureTensor::DX_2);
+    float *t_dy_2 = st->row(h - h0, StructureTensor::DY_2);
+    float *t_dxy = st->row(h - h0, StructureTensor::DXY);
+    float *t_dxt = st->row(h - h0, StructureTensor::DXT);
+    float *t_dyt = st->row(h - h0, StructureTensor::DYT);
 
-  Image<float> pImgDt = *pImg;
-  pImgDt.convolve(kt_22, 2, 2); // compute dt
+    for (int w = 0; w < width; w++) {
+      int ind = h * width + w;
+      if (tiles && !tiles->isActive(h, w))
+        continue;
+      if (texture && texture->skip && (*texture->skip)[ind])
+        continue;
 
-  // compute derivatives for cImg
-  Image<float> cImgDx = *cImg;
-  cImgDx.convolve(kx_22, 2, 2); // compute dx
+      // whole pixel displacement of the window
+      int du = (int)floor(u0->getPixel(ind));
+      int dv = (int)floor(v0->getPixel(ind));
 
-  Image<float> cImgDy = *cImg;
-  cImgDy.convolve(ky_22, 2, 2); // compute dy
+      // accumulators for the quadratic functions of the derivatives
+      float s_dx_2 = 0.0, s_dy_2 = 0.0, s_dxy = 0.0, s_dxt = 0.0;
+      float s_dyt = 0.0;
 
-  Image<float> cImgDt = *cImg;
-  cImgDt.convolve(nkt_22, 2, 2); // compute dt
+      int top = h - winSize_2;
+      int left = w - winSize_2;
+      int lo = min(0, min(dv, du));
+      int hi = max(0, max(dv, du)) + win;
 
-  // make uniform kernel
-  float *k = new float[winSize * winSize];
-  for (int i = 0; i < winSize * winSize; i++) {
-    k[i] = 1.0;
-  }
+      if (top + lo >= 0 && left + lo >= 0 && top + hi <= height &&
+          left + hi <= width) {
+        // window and displaced window inside the image
+        for (int i = 0; i < win; i++) {
+          int pind = (top + i) * width + left;
+          int cind = pind + dv * width + du;
 
-  // compute derivatives for cImg using displacements if available
-  Image<float> dx_2, dy_2, dxy, dxt, dyt;
-  if (u0 && v0) {
-    // compute derivaties for cImg using displacements
-    Image<float> pdx, pdy, pdt;
-    int winSize_2 = winSize / 2;
-
-    // initialize output images
-    dx_2.init(height, width);
-    dy_2.init(height, width);
-    dxy.init(height, width);
-    dxt.init(height, width);
-    dyt.init(height, width);
-
-    for (int h = 0; h < height; h++) {
-      for (int w = 0; w < width; w++) {
-        // initialize kernels to zeros
-        pdx.init(winSize, winSize);
-        pdy.init(winSize, winSize);
-        pdt.init(winSize, winSize);
-
-        // loop over kernel
-        for (int i = 0; i < winSize; i++) {
-          for (int j = 0; j < winSize; j++) {
-            int ip = h + i - winSize_2;
-            int jp = w + j - winSize_2;
-
-            int dip = ip + v0->getPixel(h * width + w);
-            int djp = jp + u0->getPixel(h * width + w);
-
-            if (ip >= 0 && dip >= 0 && jp >= 0 && djp >= 0 && ip < height &&
-                dip < height && jp < width && djp < width) {
-              pdx[i * winSize + j] =
-                  pImgDx[ip * width + jp] + cImgDx[dip * width + djp];
-
-              pdy[i * winSize + j] =
-                  pImgDy[ip * width + jp] + cImgDy[dip * width + djp];
-
-              pdt[i * winSize + j] =
-                  pImgDt[ip * width + jp] + cImgDt[dip * width + djp];
-            }
+          for (int j = 0; j < win; j++) {
+            float pdx = pd->dx[pind + j] + cd->dx[cind + j];
+            float pdy = pd->dy[pind + j] + cd->dy[cind + j];
+            float pdt = pd->dt[pind + j] - cd->dt[cind + j];
+
+            s_dx_2 += pdx * pdx;
+            s_dy_2 += pdy * pdy;
+            s_dxy += pdx * pdy;
+            s_dxt += pdx * pdt;
+            s_dyt += pdy * pdt;
           }
         }
+      } else {
+        // window rows and columns inside the image at both ends
+        int i0 = max(0, max(-top, -top - dv));
+        int i1 = min(win, min(height - top, height - top - dv));
+        int j0 = max(0, max(-left, -left - du));
+        int j1 = min(win, min(width - left, width - left - du));
+
+        for (int i = i0; i < i1; i++) {
+          int pind = (top + i) * width + left;
+          int cind = pind + dv * width + du;
+
+          for (int j = j0; j < j1; j++) {
+            float pdx = pd->dx[pind + j] + cd->dx[cind + j];
+            float pdy = pd->dy[pind + j] + cd->dy[cind + j];
+            float pdt = pd->dt[pind + j] - cd->dt[cind + j];
 
-        // compute quadratic functions of the the derivative estimates
-        Image<float> t_dx_2 = pdx * pdx;
-        Image<float> t_dy_2 = pdy * pdy;
-        Image<float> t_dxy = pdx * pdy;
-        Image<float> t_dxt = pdx * pdt;
-        Image<float> t_dyt = pdy * pdt;
-
-        // sum the constraints
-        dx_2[h * width + w] = t_dx_2.sum();
-        dy_2[h * width + w] = t_dy_2.sum();
-        dxy[h * width + w] = t_dxy.sum();
-        dxt[h * width + w] = t_dxt.sum();
-        dyt[h * width + w] = t_dyt.sum();
+            s_dx_2 += pdx * pdx;
+            s_dy_2 += pdy * pdy;
+            s_dxy += pdx * pdy;
+            s_dxt += pdx * pdt;
+            s_dyt += pdy * pdt;
+          }
+        }
       }
+
+      // sum the constraints
+      t_dx_2[w] = s_dx_2;
+      t_dy_2[w] = s_dy_2;
+      t_dxy[w] = s_dxy;
+      t_dxt[w] = s_dxt;
+      t_dyt[w] = s_dyt;
     }
-  } else {
-    // sum derivatives
-    Image<float> dx = pImgDx + cImgDx;
-    Image<float> dy = pImgDy + cImgDy;
-    Image<float> dt = pImgDt + cImgDt;
-
-    // compute quadratic functions of the the derivative estimates
-    dx_2 = dx * dx;
-    dy_2 = dy * dy;
-    dxy = dx * dy;
-    dxt = dx * dt;
-    dyt = dy * dt;
-
-    // convolve with uniform which accumulates constraints
-    dx_2.convolve(k, winSize, winSize);
-    dy_2.convolve(k, winSize, winSize);
-    dxy.convolve(k, winSize, winSize);
-    dxt.convolve(k, winSize, winSize);
-    dyt.convolve(k, winSize, winSize);
   }
+}
+
+/* Displaced window tensor accumulation (see accumulateWarpedTensorWin())
+   dispatched to the specializations for the common window sizes. */
+void accumulateWarpedTensor(const ImageDerivatives_t *pd,
+                            const ImageDerivatives_t *cd,
+                            const Image<float> *u0, const Image<float> *v0,
+                            const int &winSize, const int h0, const int h1,
+                            StructureTensor *st, const TileMask_t *tiles = 0,
+                            const TextureMask_t *texture = 0) {
+  switch (winSize) {
+  case 3:
+    accumulateWarpedTensorWin<3>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                 texture);
+    break;
+  case 5:
+    accumulateWarpedTensorWin<5>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                 texture);
+    break;
+  case 7:
+    accumulateWarpedTensorWin<7>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                 texture);
+    break;
+  case 9:
+    accumulateWarpedTensorWin<9>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                 texture);
+    break;
+  case 11:
+    accumulateWarpedTensorWin<11>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                  texture);
+    break;
+  case 15:
+    accumulateWarpedTensorWin<15>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                  texture);
+    break;
+  default:
+    accumulateWarpedTensorWin<0>(pd, cd, u0, v0, winSize, h0, h1, st, tiles,
+                                 texture);
+  }
+}
 
-  // compute optical flow field
+/* Solve the 2x2 Lucas and Kanade system for every pixel of image rows
+   [h0, h1) from the band of windowed tensor sums st.  The solution is the
+   motion left after cImg was displaced by (u0, v0), or by the whole pixel
+   part of (u0, v0) if wholePixel is set, and is added to that displacement.
+   Where the system is ill conditioned the estimate (u0, v0) is passed
+   through, or zero if there is no estimate.  Pixels in static tiles are set
+   to zero without reading st.  With texture, pixels in its skip mask are
+   passed through without reading st, and those and the ill conditioned
+   pixels are marked in its lowTexture mask. */
+void solveTensorBand(const StructureTensor *st, const int h0, const int h1,
+                     const Image<float> *u0, const Image<float> *v0,
+                     const bool &wholePixel, Image<float> *u,
+                     Image<float> *v, const TileMask_t *tiles = 0,
+                     TextureMask_t *texture = 0) {
+  int width = u->width();
   float m[2][2], m_inv[2][2], b[2];
-  for (int h = 0; h < height; h++) {
+  Vec2f_t vp;
+  long skipped = 0;
+
+  for (int h = h0; h < h1; h++) {
+    const float *t_dx_2 = st->row(h - h0, StructureTensor::DX_2);
+    const float *t_dy_2 = st->row(h - h0, StructureTensor::DY_2);
+    const float *t_dxy = st->row(h - h0, StructureTensor::DXY);
+    const float *t_dxt = st->row(h - h0, StructureTensor::DXT);
+    const float *t_dyt = st->row(h - h0, StructureTensor::DYT);
+
     for (int w = 0; w < width; w++) {
-      // compute second moment matrix
       int ind = h * width + w;
-      m[0][0] = dx_2[ind];
-      m[1][1] = dy_2[ind];
-      m[0][1] = m[1][0] = dxy[ind];
-      b[0] = -dxt[ind];
-      b[1] = -dyt[ind];
+      if (tiles && !tiles->isActive(h, w)) {
+        u->setPixel(ind, 0.0);
+        v->setPixel(ind, 0.0);
+        continue;
+      }
+
+      if (texture && texture->skip && (*texture->skip)[ind]) {
+        // textureless at the coarser level, pass the estimate through
+        texture->lowTexture[ind] = 1;
+        skipped++;
+        u->setPixel(ind, u0 ? u0->getPixel(ind) : 0.0);
+        v->setPixel(ind, v0 ? v0->getPixel(ind) : 0.0);
+        continue;
+      }
+
+      // compute second moment matrix
+      m[0][0] = t_dx_2[w];
+      m[1][1] = t_dy_2[w];
+      m[0][1] = m[1][0] = t_dxy[w];
+      b[0] = -t_dxt[w];
+      b[1] = -t_dyt[w];
 
       // compute determinant and trace
       float d = m[0][0] * m[1][1] - m[0][1] * m[1][0];
@@ -247,6 +661,9 @@ void computeOpticalFlow_LK(const Image<float> *pImg, const Image<float> *cImg,
       float eps = 0.001;
       if (fabs(d) < eps || fabs(eig1) < eps || fabs(eig2) < eps ||
           fabs(eig2 / eig1) < eps) {
+        if (texture)
+          texture->lowTexture[ind] = 1;
+
         if (u0 && v0) {
           u->setPixel(ind, u0->getPixel(ind));
           v->setPixel(ind, v0->getPixel(ind));
@@ -267,54 +684,1102 @@ void computeOpticalFlow_LK(const Image<float> *pImg, const Image<float> *cImg,
       vp[0] = m_inv[0][0] * b[0] + m_inv[0][1] * b[1];
       vp[1] = m_inv[1][0] * b[0] + m_inv[1][1] * b[1];
 
-      // set estimate
+      // the time derivative is pImg - cImg, so the motion is -vp
+      float su = 0.0, sv = 0.0;
       if (u0 && v0) {
-        vp[0] = 2.0 * u0->getPixel(ind) - vp[0];
-        vp[1] = 2.0 * v0->getPixel(ind) - vp[1];
+        su = u0->getPixel(ind);
+        sv = v0->getPixel(ind);
+        if (wholePixel) {
+          su = floor(su);
+          sv = floor(sv);
+        }
       }
 
+      // set estimate
+      vp[0] = su - vp[0];
+      vp[1] = sv - vp[1];
+
       u->setPixel(ind, vp[0]);
       v->setPixel(ind, vp[1]);
     }
   }
 
-  delete[] k;
+  if (texture)
+    texture->skipped += skipped;
 }
 
-/* Hierarchical Lucas and Kanade optical flow algorithm.  This also assumes
-   that the optical flow is uniform among local neighboring samples. */
-void computeOpticalFlow_HLK(const Image<float> *pImg, const Image<float> *cImg,
-                            const int &winSize, Image<float> *u,
-                            Image<float> *v) {
-  vector<Image<float> > pyramid_1, pyramid_2;
+/* Sum the pImg and cImg derivatives where the cImg derivatives are sampled
+   (bilinear) at each pixel displaced by the current estimate (u0, v0).
+   Pixels whose displacement falls outside the image are set to zero.  The
+   cImg derivatives are sampled from copies with a one pixel replicated
+   apron, which give the same values as Image<T>::bilinear() on the last
+   row and column without its edge checks. */
+void warpDerivatives(const ImageDerivatives_t *pd, const ImageDerivatives_t *cd,
+                     const Image<float> *u0, const Image<float> *v0,
+                     Image<float> *dx, Image<float> *dy, Image<float> *dt) {
+  int height = pd->dx.height();
+  int width = pd->dx.width();
+
+  dx->init(height, width);
+  dy->init(height, width);
+  dt->init(height, width);
+
+  PaddedImage<float> cdx(height, width, 1), cdy(height, width, 1);
+  PaddedImage<float> cdt(height, width, 1);
+  cdx.copyFrom(&cd->dx, BORDER_REPLICATE);
+  cdy.copyFrom(&cd->dy, BORDER_REPLICATE);
+  cdt.copyFrom(&cd->dt, BORDER_REPLICATE);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < width; w++) {
+        int ind = h * width + w;
+        float hp = h + v0->getPixel(ind);
+        float wp = w + u0->getPixel(ind);
+
+        if (hp < 0 || wp < 0 || hp > height - 1 || wp > width - 1)
+          continue;
+
+        dx->setPixel(ind, pd->dx[ind] + cdx.bilinear(hp, wp));
+        dy->setPixel(ind, pd->dy[ind] + cdy.bilinear(hp, wp));
+        dt->setPixel(ind, pd->dt[ind] - cdt.bilinear(hp, wp));
+      }
+    }
+  });
+}
+
+/* Accumulate the Lucas and Kanade constraints and solve for the optical
+   flow field one band of rows at a time, so the tensor is solved while it
+   is in cache.  The constraints are summed over a uniform window of the
+   summed derivatives dx, dy, dt or, if dx is null, over the windows of cImg
+   displaced by (u0, v0) using the per-image derivatives pd and cd.  With
+   tiles, bands without an active tile are not accumulated and the flow of
+   static tiles is zero.  With texture, see solveTensorBand(). */
+void accumulateAndSolveLK(const Image<float> *dx, const Image<float> *dy,
+                          const Image<float> *dt, const ImageDerivatives_t *pd,
+                          const ImageDerivatives_t *cd, const Image<float> *u0,
+                          const Image<float> *v0, const int &winSize,
+                          Image<float> *u, Image<float> *v,
+                          const TileMask_t *tiles = 0,
+                          TextureMask_t *texture = 0) {
+  int height = u->height();
+  int width = u->width();
+
+  int numBands = (height + TENSOR_BAND_ROWS - 1) / TENSOR_BAND_ROWS;
+  parallelFor(0, numBands, 1, [&](int b0, int b1) {
+    StructureTensor st(TENSOR_BAND_ROWS, width);
+
+    for (int b = b0; b < b1; b++) {
+      int h0 = b * TENSOR_BAND_ROWS;
+      int h1 = min(h0 + TENSOR_BAND_ROWS, height);
+
+      if (tiles && !tiles->rowsActive(h0, h1)) {
+        // static band, nothing to accumulate
+      } else if (dx) {
+        // uniform window over the summed derivatives
+        st.accumulate(dx, dy, dt, winSize, h0, h1);
+      } else {
+        // use displaced windows in cImg
+        accumulateWarpedTensor(pd, cd, u0, v0, winSize, h0, h1, &st, tiles,
+                               texture);
+      }
+
+      solveTensorBand(&st, h0, h1, u0, v0, dx == 0, u, v, tiles, texture);
+    }
+  });
+}
+
+/* Lucas and Kanade optical flow from the derivatives of the two images.
+   This is the part of computeOpticalFlow_LK that follows the derivatives,
+   so callers that keep the derivatives of a frame can reuse them.  With
+   tiles, only the active tiles are solved, and with texture the textureless
+   pixels of the coarser level are skipped (see TextureMask_t). */
+void computeOpticalFlow_LK(const ImageDerivatives_t *pd,
+                           const ImageDerivatives_t *cd,
+                           const Image<float> *u0, const Image<float> *v0,
+                           const int &winSize, Image<float> *u,
+                           Image<float> *v,
+                           const FlowParams_t &params = FlowParams_t(),
+                           const TileMask_t *tiles = 0,
+                           TextureMask_t *texture = 0) {
+  Image<float> dx, dy, dt;
+
+  if (texture) {
+    texture->lowTexture.init(u->height(), u->width());
+    texture->skipped = 0;
+  }
+
+  if (u0 && v0 && !params.warpOnce) {
+    // displaced window for every pixel
+    accumulateAndSolveLK(0, 0, 0, pd, cd, u0, v0, winSize, u, v, tiles,
+                         texture);
+    return;
+  }
+
+  if (u0 && v0) {
+    // sum derivatives with cImg warped by the current estimate
+    warpDerivatives(pd, cd, u0, v0, &dx, &dy, &dt);
+  } else {
+    // sum derivatives
+    sumDerivatives(pd, cd, &dx, &dy, &dt);
+  }
+
+  accumulateAndSolveLK(&dx, &dy, &dt, 0, 0, u0, v0, winSize, u, v, tiles,
+                       texture);
+}
+
+/* Lucas and Kanade optical flow algorithm.  This algorithm assumes the optical
+   flow is uniform among neighbors.  If given, init is the current estimate
+   that cImg is warped by. */
+void computeOpticalFlow_LK(const Image<float> *pImg, const Image<float> *cImg,
+                           const FlowField *init, const int &winSize,
+                           FlowField *flow,
+                           const FlowParams_t &params = FlowParams_t()) {
+  if (!flow->hasSize(pImg->height(), pImg->width()))
+    flow->init(pImg->height(), pImg->width());
+
+  if (init) {
+    // compute derivatives for each image
+    ImageDerivatives_t pd, cd;
+    computeDerivatives(pImg, kt_22, &pd.dx, &pd.dy, &pd.dt);
+    computeDerivatives(cImg, kt_22, &cd.dx, &cd.dy, &cd.dt);
+
+    computeOpticalFlow_LK(&pd, &cd, &init->u(), &init->v(), winSize,
+                          &flow->u(), &flow->v(), params);
+  } else {
+    // compute summed derivatives in a single pass
+    Image<float> dx, dy, dt;
+    computeDerivatives(pImg, cImg, &dx, &dy, &dt);
+
+    accumulateAndSolveLK(&dx, &dy, &dt, 0, 0, 0, 0, winSize, &flow->u(),
+                         &flow->v());
+  }
+}
+
+/* Reduce a full resolution flow component f to pyramid level l of size
+   height x width by averaging each 2^l x 2^l block of pixels and scaling
+   the displacement by 2^-l. */
+void downsampleFlow(const Image<float> *f, const int l, const int height,
+                    const int width, Image<float> *fl) {
+  int fh = f->height();
+  int fw = f->width();
+  int step = 1 << l;
+
+  fl->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < width; w++) {
+        double s = 0.0;
+        int n = 0;
+
+        for (int i = h * step; i < (h + 1) * step && i < fh; i++) {
+          for (int j = w * step; j < (w + 1) * step && j < fw; j++) {
+            s += f->getPixel(i * fw + j);
+            n++;
+          }
+        }
+
+        if (n)
+          fl->setPixel(h * width + w, s / (n * step));
+      }
+    }
+  });
+}
+
+/* Bilinear weights of the rows (r) and columns (c) of a flow upsampling,
+   see upsampleWeights2(). */
+struct UpsampleWeights_t {
+  vector<int> r0, r1, c0, c1;       // lower and upper source samples
+  vector<float> rw0, rw1, cw0, cw1; // weights of the lower and upper samples
+};
+
+/* Bilinear weights for upsampling a dimension of m samples by two to n
+   samples (n is 2m or 2m - 1), sample x = lo * wlo + hi * whi.  The weights
+   are those of Image<T>::bilinear() at x / 2, which extrapolates from the
+   last two samples past the end. */
+void upsampleWeights2(const int m, const int n, vector<int> *lo,
+                      vector<int> *hi, vector<float> *wlo,
+                      vector<float> *whi) {
+  lo->resize(n);
+  hi->resize(n);
+  wlo->resize(n);
+  whi->resize(n);
+
+  for (int x = 0; x < n; x++) {
+    float c = x / 2.0;
+    int l = (int)c;
+    int u = l + 1;
+
+    if (m == 1) {
+      l = u = 0;
+    } else if (u >= m) {
+      l--;
+      u--;
+    }
+
+    (*lo)[x] = l;
+    (*hi)[x] = u;
+    (*wlo)[x] = (m == 1) ? 1.0 : u - c;
+    (*whi)[x] = (m == 1) ? 0.0 : c - l;
+  }
+}
+
+/* Upsample the flow (u, v) of a pyramid level by two to the height x width
+   of the next finer level and scale the displacements by two, both
+   components in one pass.  The finer level is 2m or 2m - 1 pixels along a
+   dimension of m, since the pyramid rounds the halved dimensions up.  The
+   values are those of upsample2() * 2 where the sizes match.  uo and vo
+   keep their storage if they already have the output dimensions, and the
+   weights are computed in wts if given, which then keeps its storage too. */
+void upsampleFlow2(const Image<float> *u, const Image<float> *v,
+                   const int height, const int width, Image<float> *uo,
+                   Image<float> *vo, UpsampleWeights_t *wts = 0) {
+  int cw = u->width();
+
+  if (uo->height() != height || uo->width() != width)
+    uo->init(height, width);
+  if (vo->height() != height || vo->width() != width)
+    vo->init(height, width);
+
+  // the weights only depend on the row or column
+  UpsampleWeights_t local;
+  UpsampleWeights_t &wt = wts ? *wts : local;
+  upsampleWeights2(u->height(), height, &wt.r0, &wt.r1, &wt.rw0, &wt.rw1);
+  upsampleWeights2(cw, width, &wt.c0, &wt.c1, &wt.cw0, &wt.cw1);
+  const vector<int> &r0 = wt.r0, &r1 = wt.r1, &c0 = wt.c0, &c1 = wt.c1;
+  const vector<float> &rw0 = wt.rw0, &rw1 = wt.rw1;
+  const vector<float> &cw0 = wt.cw0, &cw1 = wt.cw1;
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      const float *ua = &(*u)[r0[h] * cw];
+      const float *ub = &(*u)[r1[h] * cw];
+      const float *va = &(*v)[r0[h] * cw];
+      const float *vb = &(*v)[r1[h] * cw];
+      float *ud = &(*uo)[h * width];
+      float *vd = &(*vo)[h * width];
+
+      for (int w = 0; w < width; w++) {
+        int l = c0[w], r = c1[w];
+        float t0 = cw0[w] * ua[l] + cw1[w] * ua[r];
+        float t1 = cw0[w] * ub[l] + cw1[w] * ub[r];
+        ud[w] = (rw0[h] * t0 + rw1[h] * t1) * (float)2.0;
+
+        t0 = cw0[w] * va[l] + cw1[w] * va[r];
+        t1 = cw0[w] * vb[l] + cw1[w] * vb[r];
+        vd[w] = (rw0[h] * t0 + rw1[h] * t1) * (float)2.0;
+      }
+    }
+  });
+}
+
+/* Decide whether the flow (u0, v0) of the previous frame pair is a usable
+   starting point for the pair pImg, cImg.  It is not if the frames differ
+   by more than sceneChangeThreshold of the mean intensity (a scene change),
+   or if cImg displaced by (u0, v0) matches pImg worse than cImg itself.
+   The row sums are kept in scratch if given. */
+bool acceptWarmStart(const Image<float> *pImg, const Image<float> *cImg,
+                     const Image<float> *u0, const Image<float> *v0,
+                     const float &sceneChangeThreshold,
+                     vector<double> *scratch = 0) {
+  int height = pImg->height();
+  int width = pImg->width();
+
+  // per row sums of intensity, frame difference and displaced difference,
+  // added up in order so the result does not depend on the thread count
+  vector<double> local;
+  vector<double> &rowSum = scratch ? *scratch : local;
+  rowSum.assign(3 * height, 0.0);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      double si = 0.0, sz = 0.0, sw = 0.0;
+
+      for (int w = 0; w < width; w++) {
+        int ind = h * width + w;
+        float p = pImg->getPixel(ind);
+        float hp = h + v0->getPixel(ind);
+        float wp = w + u0->getPixel(ind);
+
+        // displaced outside the image, clamp to the nearest edge pixel
+        hp = min(max(hp, 0.0f), (float)(height - 1));
+        wp = min(max(wp, 0.0f), (float)(width - 1));
+
+        si += fabs(p);
+        sz += fabs(p - cImg->getPixel(ind));
+        sw += fabs(p - cImg->bilinear(hp, wp));
+      }
 
-  // compute gaussian pyramids for both images
-  pImg->pyramid(NUM_LEVELS, pyramid_1);
-  cImg->pyramid(NUM_LEVELS, pyramid_2);
+      rowSum[3 * h] = si;
+      rowSum[3 * h + 1] = sz;
+      rowSum[3 * h + 2] = sw;
+    }
+  });
+
+  double intensity = 0.0, zeroResidual = 0.0, warmResidual = 0.0;
+  for (int h = 0; h < height; h++) {
+    intensity += rowSum[3 * h];
+    zeroResidual += rowSum[3 * h + 1];
+    warmResidual += rowSum[3 * h + 2];
+  }
+
+  if (zeroResidual > sceneChangeThreshold * intensity)
+    return (false);
+
+  return (warmResidual <= zeroResidual);
+}
+
+/* Skip mask of a height x width pyramid level from the low texture mask of
+   the next coarser level: a pixel is skipped if the coarser pixel it came
+   from and all its neighbours were textureless, so that texture near the
+   edge of a flat region, which the coarser level may have blurred away, is
+   still solved. */
+void propagateLowTexture(const Image<unsigned char> *coarse, const int height,
+                         const int width, Image<unsigned char> *skip) {
+  int ch = coarse->height();
+  int cw = coarse->width();
+
+  skip->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      int hc = min(h / 2, ch - 1);
+
+      for (int w = 0; w < width; w++) {
+        int wc = min(w / 2, cw - 1);
+        unsigned char s = 1;
+
+        for (int i = max(hc - 1, 0); i <= min(hc + 1, ch - 1) && s; i++) {
+          for (int j = max(wc - 1, 0); j <= min(wc + 1, cw - 1); j++) {
+            s &= (*coarse)[i * cw + j];
+          }
+        }
+
+        (*skip)[h * width + w] = s;
+      }
+    }
+  });
+}
+
+/* Per-level masks and scratch of a hierarchical Lucas and Kanade estimate.
+   Kept from one estimate to the next, as FlowStream does, every buffer
+   keeps its storage, so estimates of frames of the same size allocate no
+   memory. */
+struct HLKLevels_t {
+  int numLevels;                      // levels used
+  vector<TileMask_t> tiles;           // active tiles of every level, or none
+  vector<TextureMask_t> texture;      // texture masks of every level, or none
+  vector<Image<unsigned char> > skip; // skip masks derived from texture
+  Image<float> u0, v0;                // upsampled estimate of a finer level
+  Image<float> us, vs;                // seed reduced to the starting level
+  UpsampleWeights_t weights;          // weights of the upsampling
+  vector<float> mag;                  // flow magnitudes, levelsForMotion()
+  vector<double> rowSum;              // row sums, acceptWarmStart()
+
+  HLKLevels_t() : numLevels(0) {}
+
+  const TileMask_t *tilesAt(const int l) const {
+    return (tiles.empty() ? 0 : &tiles[l]);
+  }
+
+  TextureMask_t *textureAt(const int l) {
+    return (texture.empty() ? 0 : &texture[l]);
+  }
+
+  /* Size the masks for an estimate from the pyramids pp with tiles (full
+     resolution, or null) and texture masks if useTexture. */
+  void init(const FramePyramid_t *pp, const FlowParams_t &params,
+            const TileMask_t *t, const bool useTexture) {
+    numLevels = pp->levels.size();
+    if (params.numLevels != ADAPTIVE_LEVELS)
+      numLevels = min(numLevels, params.numLevels);
+
+    // the masks hold an atomic counter, so they are replaced, not resized;
+    // kept masks are cleared, as levels that are not solved count zero
+    unsigned n = useTexture ? numLevels : 0;
+    if (texture.size() != n)
+      texture = vector<TextureMask_t>(n);
+    for (unsigned l = 0; l < n; l++) {
+      Image<unsigned char> &lt = texture[l].lowTexture;
+      lt.init(lt.height(), lt.width());
+      texture[l].skip = 0;
+      texture[l].skipped = 0;
+    }
+    skip.resize(numLevels);
+
+    // address the tiles with the pixels of every level
+    tiles.resize(t ? numLevels : 0);
+    for (unsigned l = 0; l < tiles.size(); l++) {
+      tiles[l] = *t;
+      tiles[l].level = l;
+    }
+  }
+};
+
+/* The starting estimate (u, v) of hierarchical Lucas and Kanade, see
+   computeOpticalFlow_HLK().  Returns the level of the estimate and sets
+   warm if the seed (uPrev, vPrev) was used. */
+int startHLK(const FramePyramid_t *pp, const FramePyramid_t *cp,
+             const Image<float> *uPrev, const Image<float> *vPrev,
+             const int &winSize, Image<float> *u, Image<float> *v,
+             const FlowParams_t &params, HLKLevels_t *lv, bool *warm) {
+  int numLevels = lv->numLevels;
+  int top = numLevels - 1;
+
+  *warm = false;
+  if (uPrev && vPrev) {
+    if (uPrev->height() != pp->levels[0].height() ||
+        uPrev->width() != pp->levels[0].width()) {
+      throw Exception("warm start flow does not match the frame dimensions");
+    }
+
+    top = min(max(params.warmStartLevel, 0), numLevels - 1);
+    const Image<float> &im = pp->levels[top];
+
+    Image<float> &us = lv->us, &vs = lv->vs;
+    downsampleFlow(uPrev, top, im.height(), im.width(), &us);
+    downsampleFlow(vPrev, top, im.height(), im.width(), &vs);
+
+    *warm = acceptWarmStart(&pp->levels[top], &cp->levels[top], &us, &vs,
+                            params.sceneChangeThreshold, &lv->rowSum);
+    if (*warm) {
+      u->init(im.height(), im.width());
+      v->init(im.height(), im.width());
+
+      // refine the seed at the starting level
+      computeOpticalFlow_LK(&pp->derivs[top], &cp->derivs[top], &us, &vs,
+                            winSize, u, v, params, lv->tilesAt(top),
+                            lv->textureAt(top));
+      return (top);
+    }
+
+    top = numLevels - 1;
+  }
 
   // compute simple estimates using LK at highest level
-  Image<float> &im1 = pyramid_1.back();
-  Image<float> &im2 = pyramid_2.back();
+  const Image<float> &im1 = pp->levels[top];
   u->init(im1.height(), im1.width());
   v->init(im1.height(), im1.width());
 
   // initial estimate at lowest resolution
-  computeOpticalFlow_LK(&im1, &im2, 0, 0, winSize, u, v);
+  computeOpticalFlow_LK(&pp->derivs[top], &cp->derivs[top], 0, 0, winSize, u,
+                        v, params, lv->tilesAt(top), lv->textureAt(top));
+
+  if (params.numLevels == ADAPTIVE_LEVELS) {
+    // start at the coarsest level the motion needs
+    int levels = levelsForMotion(u, v, top, numLevels, &lv->mag);
+
+    if (levels < numLevels) {
+      top = levels - 1;
+      const Image<float> &im = pp->levels[top];
+      u->init(im.height(), im.width());
+      v->init(im.height(), im.width());
+
+      computeOpticalFlow_LK(&pp->derivs[top], &cp->derivs[top], 0, 0,
+                            winSize, u, v, params, lv->tilesAt(top),
+                            lv->textureAt(top));
+    }
+  }
+
+  return (top);
+}
 
+/* Refine the estimate (u, v) at level top of hierarchical Lucas and Kanade
+   through all the finer levels, see computeOpticalFlow_HLK(). */
+void refineHLK(const FramePyramid_t *pp, const FramePyramid_t *cp,
+               const int top, const int &winSize, Image<float> *u,
+               Image<float> *v, const FlowParams_t &params,
+               HLKLevels_t *lv) {
   // process all the levels from small to large
-  for (int l = NUM_LEVELS - 2; l >= 0; l--) {
-    // upsample2 u_i*, v_i* (bilinear) and multiply u_i*, v_i* by 2
-    Image<float> u0 = u->upsample2() * 2.0;
-    Image<float> v0 = v->upsample2() * 2.0;
+  Image<float> &u0 = lv->u0, &v0 = lv->v0;
+  for (int l = top - 1; l >= 0; l--) {
+    const Image<float> &im = pp->levels[l];
+
+    // upsample u_i*, v_i* (bilinear) to this level and multiply by 2
+    upsampleFlow2(u, v, im.height(), im.width(), &u0, &v0, &lv->weights);
 
     // compute optical flow at next level
-    im1 = pyramid_1[l];
-    im2 = pyramid_2[l];
-    u->init(im1.height(), im1.width());
-    v->init(im1.height(), im1.width());
+    u->init(im.height(), im.width());
+    v->init(im.height(), im.width());
+
+    // skip what was textureless at the coarser level
+    if (params.textureSkip) {
+      propagateLowTexture(&lv->texture[l + 1].lowTexture, im.height(),
+                          im.width(), &lv->skip[l]);
+      lv->texture[l].skip = &lv->skip[l];
+    }
 
     // compute optical flow estimate update
-    computeOpticalFlow_LK(&im1, &im2, &u0, &v0, winSize, u, v);
+    computeOpticalFlow_LK(&pp->derivs[l], &cp->derivs[l], &u0, &v0, winSize,
+                          u, v, params, lv->tilesAt(l), lv->textureAt(l));
+  }
+}
+
+/* Hierarchical Lucas and Kanade optical flow from the pyramids and
+   derivatives of two frames, seeded with the full resolution flow
+   (uPrev, vPrev) of the previous frame pair.  The seed is reduced to level
+   params.warmStartLevel and refined from there, so the coarser levels are
+   skipped.  Without a seed, or when acceptWarmStart() rejects it, the flow
+   is estimated from zero at the coarsest level.  With tiles (full
+   resolution), only the active tiles are solved at every level and the flow
+   of static tiles is zero.
+
+   A fixed params.numLevels uses at most that many of the levels.  With
+   ADAPTIVE_LEVELS the coarsest level estimate also measures the motion of
+   the pair, and refinement starts at the coarsest level that motion needs
+   (see levelsForMotion()), so small motion skips the coarse levels.  Both
+   pyramids must have the same number of levels.
+
+   With params.textureSkip the pixels that were textureless about the same
+   place at the coarser level are not solved again at the finer levels (see
+   propagateLowTexture()).  If stats is given the number of skipped and ill
+   conditioned pixels of every level is returned in it.  A scratch kept by
+   the caller from one call to the next saves the per-level buffers.
+   Returns true if the seed was used. */
+bool computeOpticalFlow_HLK(const FramePyramid_t *pp, const FramePyramid_t *cp,
+                            const Image<float> *uPrev,
+                            const Image<float> *vPrev, const int &winSize,
+                            Image<float> *u, Image<float> *v,
+                            const FlowParams_t &params = FlowParams_t(),
+                            const TileMask_t *tiles = 0,
+                            FlowStats_t *stats = 0,
+                            HLKLevels_t *scratch = 0) {
+  HLKLevels_t local;
+  HLKLevels_t &lv = scratch ? *scratch : local;
+  lv.init(pp, params, tiles, params.textureSkip || stats);
+
+  bool warm;
+  int top = startHLK(pp, cp, uPrev, vPrev, winSize, u, v, params, &lv, &warm);
+  refineHLK(pp, cp, top, winSize, u, v, params, &lv);
+
+  if (stats) {
+    stats->skipped.assign(pp->levels.size(), 0);
+    stats->lowTexture.assign(pp->levels.size(), 0);
+
+    for (int l = 0; l < lv.numLevels; l++) {
+      const Image<unsigned char> &lt = lv.texture[l].lowTexture;
+      stats->skipped[l] = lv.texture[l].skipped;
+      for (int i = 0; i < lt.height() * lt.width(); i++) {
+        stats->lowTexture[l] += lt[i];
+      }
+    }
+  }
+
+  return (warm);
+}
+
+/* Hierarchical Lucas and Kanade optical flow from the pyramids and
+   derivatives of two frames.  Both pyramids must have the same number of
+   levels. */
+void computeOpticalFlow_HLK(const FramePyramid_t *pp, const FramePyramid_t *cp,
+                            const int &winSize, Image<float> *u,
+                            Image<float> *v,
+                            const FlowParams_t &params = FlowParams_t()) {
+  computeOpticalFlow_HLK(pp, cp, 0, 0, winSize, u, v, params);
+}
+
+/* Hierarchical Lucas and Kanade optical flow algorithm.  This also assumes
+   that the optical flow is uniform among local neighboring samples.
+
+   Note: With params.warpOnce the finer levels warp the cImg derivatives once
+         per level and reuse the box filtered accumulation of the coarsest
+         level, instead of gathering a displaced window for every pixel. */
+void computeOpticalFlow_HLK(const Image<float> *pImg, const Image<float> *cImg,
+                            const int &winSize, FlowField *flow,
+                            const FlowParams_t &params = FlowParams_t()) {
+  FramePyramid_t pyramid_1, pyramid_2;
+
+  // compute gaussian pyramids and derivatives for both images
+  int numLevels = pyramidLevels(params, pImg->height(), pImg->width());
+  buildFramePyramid(pImg, numLevels, &pyramid_1);
+  buildFramePyramid(cImg, numLevels, &pyramid_2);
+
+  computeOpticalFlow_HLK(&pyramid_1, &pyramid_2, winSize, &flow->u(),
+                         &flow->v(), params);
+}
+
+/* Forward-backward consistency of the forward flow f from pImg to cImg and
+   the backward flow b from cImg to pImg, in one pass.  For
+   each pixel x the backward flow is sampled (bilinear) at x + f(x) and the
+   squared length e of f(x) + b(x + f(x)) is compared with
+   t = params.fbAlpha * (|f|^2 + |b|^2) + params.fbBeta.  occlusion is set
+   where e > t or x + f(x) leaves the image, and confidence is exp(-e / t),
+   which is 1 for consistent flow and 1/e at the occlusion threshold.  Either
+   output may be null. */
+void checkFlowConsistency(const FlowField *fwd, const FlowField *bwd,
+                          const FlowParams_t &params,
+                          Image<unsigned char> *occlusion,
+                          Image<float> *confidence) {
+  const Image<float> &uf = fwd->u();
+  const Image<float> &vf = fwd->v();
+  const Image<float> &ub = bwd->u();
+  const Image<float> &vb = bwd->v();
+  int height = fwd->height();
+  int width = fwd->width();
+
+  if (occlusion)
+    occlusion->init(height, width);
+  if (confidence)
+    confidence->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < width; w++) {
+        int ind = h * width + w;
+        float fu = uf[ind];
+        float fv = vf[ind];
+        float hp = h + fv;
+        float wp = w + fu;
+
+        if (hp < 0 || wp < 0 || hp > height - 1 || wp > width - 1) {
+          // moves out of the frame
+          if (occlusion)
+            (*occlusion)[ind] = 1;
+          continue;
+        }
+
+        float bu = ub.bilinear(hp, wp);
+        float bv = vb.bilinear(hp, wp);
+        float e = (fu + bu) * (fu + bu) + (fv + bv) * (fv + bv);
+        float t = params.fbAlpha * (fu * fu + fv * fv + bu * bu + bv * bv) +
+                  params.fbBeta;
+
+        if (occlusion)
+          (*occlusion)[ind] = (e > t);
+        if (confidence)
+          (*confidence)[ind] = exp(-e / t);
+      }
+    }
+  });
+}
+
+/* Forward (fwd) and backward (bwd) hierarchical Lucas and Kanade optical
+   flow between two frames from one set of pyramids and derivatives.
+   The derivatives of a pair are sums and differences of the per-frame
+   derivatives, so the backward direction only swaps the frames.  At the
+   starting level, which is solved from zero flow, the backward pair has the
+   same summed dx and dy and the negated dt, so its structure tensors and
+   texture masks are the forward ones and its flow is exactly the negated
+   forward flow.  That level is solved once; only the finer levels, which
+   are warped by the estimate of each direction, are solved twice. */
+void computeOpticalFlow_BiHLK(const FramePyramid_t *pp,
+                              const FramePyramid_t *cp, const int &winSize,
+                              FlowField *fwd, FlowField *bwd,
+                              const FlowParams_t &params = FlowParams_t()) {
+  HLKLevels_t fl, bl;
+  fl.init(pp, params, 0, params.textureSkip);
+  bl.init(cp, params, 0, params.textureSkip);
+
+  bool warm;
+  int top = startHLK(pp, cp, 0, 0, winSize, &fwd->u(), &fwd->v(), params,
+                     &fl, &warm);
+
+  // the backward start is the negated forward start
+  bwd->u() = fwd->u() * -1.0f;
+  bwd->v() = fwd->v() * -1.0f;
+  if (params.textureSkip)
+    bl.texture[top].lowTexture = fl.texture[top].lowTexture;
+
+  refineHLK(pp, cp, top, winSize, &fwd->u(), &fwd->v(), params, &fl);
+  refineHLK(cp, pp, top, winSize, &bwd->u(), &bwd->v(), params, &bl);
+}
+
+/* Bidirectional hierarchical Lucas and Kanade optical flow with the
+   occlusion and confidence masks of the forward flow (see
+   checkFlowConsistency(); either may be null).  The pyramids and
+   derivatives of each image are built once for both directions. */
+void computeOpticalFlow_BiHLK(const Image<float> *pImg,
+                              const Image<float> *cImg, const int &winSize,
+                              FlowField *fwd, FlowField *bwd,
+                              Image<unsigned char> *occlusion,
+                              Image<float> *confidence,
+                              const FlowParams_t &params = FlowParams_t()) {
+  FramePyramid_t pyramid_1, pyramid_2;
+
+  int numLevels = pyramidLevels(params, pImg->height(), pImg->width());
+  buildFramePyramid(pImg, numLevels, &pyramid_1);
+  buildFramePyramid(cImg, numLevels, &pyramid_2);
+
+  computeOpticalFlow_BiHLK(&pyramid_1, &pyramid_2, winSize, fwd, bwd, params);
+
+  if (occlusion || confidence)
+    checkFlowConsistency(fwd, bwd, params, occlusion, confidence);
+}
+
+/* Copy the height x width region of src with top left corner (h0, w0). */
+void cropImage(const Image<float> *src, const int h0, const int w0,
+               const int height, const int width, Image<float> *dst) {
+  dst->init(height, width);
+
+  for (int h = 0; h < height; h++) {
+    memcpy(&(*dst)[h * width], &(*src)[(h0 + h) * src->width() + w0],
+           width * sizeof(float));
+  }
+}
+
+/* Hierarchical Lucas and Kanade optical flow computed over overlapping
+   tiles, so the working set stays within params.tileMemoryBudget however
+   large the frames are.  Each tile is cropped with a halo covering the
+   reach of the pyramid filters and LK windows of every level, which grows
+   by a factor of two per level, plus params.tileMotionMargin, and only the
+   flow of the tile without its halo is kept.  Tiles start on multiples of
+   the coarsest level's pixel size so every pyramid level samples the same
+   grid as the whole frame.  Results match the whole frame
+   computeOpticalFlow_HLK() up to the motion margin, and exactly if the
+   frame fits in one tile.
+
+   Note: The budget excludes the full resolution flow field. */
+void computeOpticalFlow_HLKTiled(const Image<float> *pImg,
+                                 const Image<float> *cImg, const int &winSize,
+                                 FlowField *flow,
+                                 const FlowParams_t &params = FlowParams_t()) {
+  int height = pImg->height();
+  int width = pImg->width();
+  int align = 1 << (pyramidLevels(params, height, width) - 1);
+
+  // halo of the coarsest to the finest level, rounded up to the alignment
+  int halo = (winSize / 2 + PYRAMID_FILTER_RADIUS) * (2 * align - 1) +
+             params.tileMotionMargin;
+  halo = (halo + align - 1) / align * align;
+
+  // largest square crop that fits the budget
+  int side = sqrt((double)params.tileMemoryBudget / HLK_BYTES_PER_PIXEL);
+  int core = (side - 2 * halo) / align * align;
+  if (core <= 0) {
+    throw Exception("tile memory budget is too small for the tile halo");
+  }
+
+  flow->init(height, width);
+  Image<float> &u = flow->u();
+  Image<float> &v = flow->v();
+
+  Image<float> pTile, cTile;
+  FlowField tile;
+  for (int th0 = 0; th0 < height; th0 += core) {
+    int th1 = min(th0 + core, height);
+    int ch0 = max(th0 - halo, 0);
+    int ch1 = min(th1 + halo, height);
+
+    for (int tw0 = 0; tw0 < width; tw0 += core) {
+      int tw1 = min(tw0 + core, width);
+      int cw0 = max(tw0 - halo, 0);
+      int cw1 = min(tw1 + halo, width);
+
+      cropImage(pImg, ch0, cw0, ch1 - ch0, cw1 - cw0, &pTile);
+      cropImage(cImg, ch0, cw0, ch1 - ch0, cw1 - cw0, &cTile);
+
+      computeOpticalFlow_HLK(&pTile, &cTile, winSize, &tile, params);
+
+      // keep the flow of the tile without its halo
+      for (int h = th0; h < th1; h++) {
+        memcpy(&u[h * width + tw0],
+               &tile.u()[(h - ch0) * tile.width() + tw0 - cw0],
+               (tw1 - tw0) * sizeof(float));
+        memcpy(&v[h * width + tw0],
+               &tile.v()[(h - ch0) * tile.width() + tw0 - cw0],
+               (tw1 - tw0) * sizeof(float));
+      }
+    }
+  }
+}
+
+/* Central difference gradients of img, one sided at the image border. */
+void computeCentralGradients(const Image<float> *img, Image<float> *dx,
+                             Image<float> *dy) {
+  int height = img->height();
+  int width = img->width();
+
+  dx->init(height, width);
+  dy->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      int hm = max(h - 1, 0);
+      int hq = min(h + 1, height - 1);
+
+      for (int w = 0; w < width; w++) {
+        int wm = max(w - 1, 0);
+        int wq = min(w + 1, width - 1);
+
+        dx->setPixel(h * width + w,
+                     (img->getPixel(h * width + wq) -
+                      img->getPixel(h * width + wm)) /
+                         max(wq - wm, 1));
+        dy->setPixel(h * width + w,
+                     (img->getPixel(hq * width + w) -
+                      img->getPixel(hm * width + w)) /
+                         max(hq - hm, 1));
+      }
+    }
+  });
+}
+
+/* Resample a flow component f to height x width where the new grid is
+   scale times finer, scaling the displacements by scale. */
+void resampleFlow(const Image<float> *f, const float &scale, const int height,
+                  const int width, Image<float> *fs) {
+  fs->init(height, width);
+
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    for (int h = h0; h < h1; h++) {
+      for (int w = 0; w < width; w++) {
+        fs->setPixel(h * width + w,
+                     scale * sampleClamped(f, h / scale, w / scale));
+      }
+    }
+  });
+}
+
+/* Start positions of patches of size ps every stride pixels along a
+   dimension of length n, with the last patch against the far edge so the
+   patches cover every pixel. */
+void patchPositions(const int n, const int ps, const int stride,
+                    vector<int> *pos) {
+  pos->clear();
+  for (int p = 0; p + ps < n; p += stride) {
+    pos->push_back(p);
+  }
+  pos->push_back(max(n - ps, 0));
+}
+
+/* Inverse compositional search for the displacement of one ps x ps patch of
+   pImg with top left corner (py, px) in cImg, starting from (pu, pv).  The
+   gradients and Hessian are those of the pImg patch, so they are computed
+   once and each iteration only samples cImg at the displaced patch.  The
+   whole patch has the same displacement, so when the displaced patch lies
+   within the apron of cImg it is sampled with one set of bilinear weights
+   and no bounds checks, otherwise each sample is clamped. */
+void searchPatchDIS(const Image<float> *pImg, const PaddedImage<float> *cImg,
+                    const Image<float> *dx, const Image<float> *dy,
+                    const int py, const int px, const int ps,
+                    const int numIters, float *pu, float *pv) {
+  int width = pImg->width();
+  int pw = min(ps, width - px);
+  int ph = min(ps, pImg->height() - py);
+  double h11 = 0.0, h12 = 0.0, h22 = 0.0;
+
+  // hessian of the pImg patch
+  for (int i = py; i < py + ph; i++) {
+    for (int j = px; j < px + pw; j++) {
+      float gx = dx->getPixel(i * width + j);
+      float gy = dy->getPixel(i * width + j);
+      h11 += gx * gx;
+      h12 += gx * gy;
+      h22 += gy * gy;
+    }
+  }
+
+  double d = h11 * h22 - h12 * h12;
+  if (d < 1e-3 * (h11 + h22 + 1.0))
+    return; // flat or edge only patch, keep the initial estimate
+
+  float u0 = *pu, v0 = *pv;
+  float u = u0, v = v0;
+
+  for (int it = 0; it < numIters; it++) {
+    double b1 = 0.0, b2 = 0.0;
+    float fv = floor(v), fu = floor(u);
+    int iv = (int)fv, iu = (int)fu;
+
+    if (cImg->inApron(py + iv, px + iu, py + ph + iv, px + pw + iu)) {
+      // whole pixel offset and fractional weights shared by the patch
+      float a = u - fu, b = v - fv;
+
+      for (int i = py; i < py + ph; i++) {
+        const float *r0 = cImg->row(i + iv) + iu;
+        const float *r1 = cImg->row(i + iv + 1) + iu;
+        const float *p = &(*pImg)[i * width];
+        const float *gx = &(*dx)[i * width];
+        const float *gy = &(*dy)[i * width];
+
+        for (int j = px; j < px + pw; j++) {
+          float t0 = (1.0f - a) * r0[j] + a * r0[j + 1];
+          float t1 = (1.0f - a) * r1[j] + a * r1[j + 1];
+          float e = (1.0f - b) * t0 + b * t1 - p[j];
+          b1 += gx[j] * e;
+          b2 += gy[j] * e;
+        }
+      }
+    } else {
+      for (int i = py; i < py + ph; i++) {
+        for (int j = px; j < px + pw; j++) {
+          int ind = i * width + j;
+          float e = cImg->sample(i + v, j + u) - pImg->getPixel(ind);
+          b1 += dx->getPixel(ind) * e;
+          b2 += dy->getPixel(ind) * e;
+        }
+      }
+    }
+
+    // compose the inverted update
+    float du = (h22 * b1 - h12 * b2) / d;
+    float dv = (h11 * b2 - h12 * b1) / d;
+    u -= du;
+    v -= dv;
+
+    if (du * du + dv * dv < 1e-4)
+      break;
+  }
+
+  // a patch that moved further than its size has diverged
+  if ((u - u0) * (u - u0) + (v - v0) * (v - v0) > ps * ps)
+    return;
+
+  *pu = u;
+  *pv = v;
+}
+
+/* Dense inverse search at one pyramid level.  The displacement of a grid of
+   patches is found from the current estimate (u, v) with searchPatchDIS(),
+   then every pixel is set to the average of the patches covering it, each
+   weighted by how well it matches that pixel (the inverse of the absolute
+   displaced frame difference). */
+void computeLevelDIS(const Image<float> *pImg, const Image<float> *cImg,
+                     const FlowParams_t &params, Image<float> *u,
+                     Image<float> *v) {
+  int height = pImg->height();
+  int width = pImg->width();
+  int ps = min(params.disPatchSize, min(height, width));
+  int stride = max(params.disPatchStride, 1);
+
+  Image<float> dx, dy;
+  computeCentralGradients(pImg, &dx, &dy);
+
+  // cImg with an apron for the patches displaced across the border
+  PaddedImage<float> cPad(height, width, ps);
+  cPad.copyFrom(cImg, BORDER_REPLICATE);
+
+  vector<int> ys, xs;
+  patchPositions(height, ps, stride, &ys);
+  patchPositions(width, ps, stride, &xs);
+
+  int numX = xs.size();
+  vector<float> pu(ys.size() * numX), pv(ys.size() * numX);
+
+  // search every patch starting from the estimate at its center
+  parallelFor(0, ys.size(), 1, [&](int r0, int r1) {
+    for (int r = r0; r < r1; r++) {
+      for (int c = 0; c < numX; c++) {
+        int ind = min(ys[r] + ps / 2, height - 1) * width +
+                  min(xs[c] + ps / 2, width - 1);
+        float fu = u->getPixel(ind);
+        float fv = v->getPixel(ind);
+
+        searchPatchDIS(pImg, &cPad, &dx, &dy, ys[r], xs[c], ps,
+                       params.disIters, &fu, &fv);
+
+        pu[r * numX + c] = fu;
+        pv[r * numX + c] = fv;
+      }
+    }
+  });
+
+  // densify, each band of rows gathers the patches that overlap it
+  parallelFor(0, height, PARALLEL_ROWS, [&](int h0, int h1) {
+    vector<double> su(width), sv(width), sw(width);
+
+    for (int h = h0; h < h1; h++) {
+      fill(su.begin(), su.end(), 0.0);
+      fill(sv.begin(), sv.end(), 0.0);
+      fill(sw.begin(), sw.end(), 0.0);
+
+      for (unsigned r = 0; r < ys.size(); r++) {
+        if (h < ys[r] || h >= ys[r] + ps)
+          continue;
+
+        for (int c = 0; c < numX; c++) {
+          float fu = pu[r * numX + c];
+          float fv = pv[r * numX + c];
+          int w1 = min(xs[c] + ps, width);
+
+          float ffu = floor(fu), ffv = floor(fv);
+          int iu = (int)ffu, iv = (int)ffv;
+          bool inside = cPad.inApron(h + iv, xs[c] + iu, h + iv + 1, w1 + iu);
+
+          // same displacement along the patch row, see searchPatchDIS()
+          // the row pointers only exist when the patch row is in the apron
+          float a = fu - ffu, b = fv - ffv;
+          const float *r0 = 0, *r1 = 0;
+          if (inside) {
+            r0 = cPad.row(h + iv) + iu;
+            r1 = r0 + cPad.stride();
+          }
+          const float *p = &(*pImg)[h * width];
+
+          for (int w = xs[c]; w < w1; w++) {
+            float cv;
+            if (inside) {
+              cv = (1.0f - b) * ((1.0f - a) * r0[w] + a * r0[w + 1]) +
+                   b * ((1.0f - a) * r1[w] + a * r1[w + 1]);
+            } else {
+              cv = cPad.sample(h + fv, w + fu);
+            }
+
+            float e = cv - p[w];
+            double wt = 1.0 / max(fabs(e), (float)1.0);
+
+            su[w] += wt * fu;
+            sv[w] += wt * fv;
+            sw[w] += wt;
+          }
+        }
+      }
+
+      for (int w = 0; w < width; w++) {
+        if (sw[w] > 0.0) {
+          u->setPixel(h * width + w, su[w] / sw[w]);
+          v->setPixel(h * width + w, sv[w] / sw[w]);
+        }
+      }
+    }
+  });
+}
+
+/* Dense inverse search optical flow (Kroeger et al.).  Instead of solving LK
+   at every pixel of every level, a sparse grid of patches is aligned by
+   inverse compositional search and the patch displacements are averaged
+   into a dense field, from the coarsest pyramid level down to
+   params.disFinestLevel.  The flow is then interpolated to full resolution.
+   Use setDISQuality() to trade accuracy for speed. */
+void computeOpticalFlow_DIS(const Image<float> *pImg, const Image<float> *cImg,
+                            FlowField *flow,
+                            const FlowParams_t &params = FlowParams_t()) {
+  vector<Image<float> > pyramid_1, pyramid_2;
+
+  // coarsest level still holds a couple of patches in each dimension
+  int numLevels = 1;
+  int minDim = min(pImg->height(), pImg->width());
+  while ((minDim >> numLevels) >= 2 * params.disPatchSize) {
+    numLevels++;
+  }
+  int finest = min(max(params.disFinestLevel, 0), numLevels - 1);
+
+  pImg->pyramid(numLevels, pyramid_1);
+  cImg->pyramid(numLevels, pyramid_2);
+
+  // start from zero at the coarsest level
+  Image<float> ul(pyramid_1.back().height(), pyramid_1.back().width());
+  Image<float> vl(pyramid_1.back().height(), pyramid_1.back().width());
+
+  for (int l = numLevels - 1; l >= finest; l--) {
+    if (l < numLevels - 1) {
+      // carry the estimate of the coarser level to this one
+      Image<float> uc = ul, vc = vl;
+      resampleFlow(&uc, 2.0, pyramid_1[l].height(), pyramid_1[l].width(), &ul);
+      resampleFlow(&vc, 2.0, pyramid_1[l].height(), pyramid_1[l].width(), &vl);
+    }
+
+    computeLevelDIS(&pyramid_1[l], &pyramid_2[l], params, &ul, &vl);
+  }
+
+  if (finest == 0) {
+    flow->u() = move(ul);
+    flow->v() = move(vl);
+  } else {
+    float scale = 1 << finest;
+    resampleFlow(&ul, scale, pImg->height(), pImg->width(), &flow->u());
+    resampleFlow(&vl, scale, pImg->height(), pImg->width(), &flow->v());
   }
 }
 
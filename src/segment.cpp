@@ -5,11 +5,14 @@
 
 using namespace std;
 
+#include "BufferPool.h"
 #include "DisjointSet.h"
 #include "Edge.h"
 #include "Exception.h"
 #include "FileStreamDecoder.h"
+#include "FlowField.h"
 #include "Image.h"
+#include "flowBatch.h"
 #include "gaussian.h"
 #include "graphCol.h"
 #include "graphGen.h"
@@ -24,10 +27,29 @@ int main(int argc, char **argv) {
   string vidFname;
   unsigned tsteps;
   unsigned winSize;
+  FlowParams_t params;
+  bool verbose = false;
+  bool usage = (argc < 7);
+
+  // options after the arguments, all off by default
+  for (int i = 7; i < argc && !usage; i++) {
+    string opt = argv[i];
+    if (opt == "-gate")
+      params.motionGate = true;
+    else if (opt == "-adaptive")
+      params.numLevels = ADAPTIVE_LEVELS;
+    else if (opt == "-textureskip")
+      params.textureSkip = true;
+    else if (opt == "-verbose")
+      verbose = true;
+    else
+      usage = true;
+  }
 
-  if (argc != 7) {
+  if (usage) {
     cerr << argv[0] << " <video stream file> <sigma> <winSize> <tsteps>"
-         << " <threshold> <minSize>" << endl;
+         << " <threshold> <minSize> [-gate] [-adaptive] [-textureskip]"
+         << " [-verbose]" << endl;
     return (1);
   }
 
@@ -43,96 +65,110 @@ int main(int argc, char **argv) {
     cerr << " * initializing video stream decoder" << endl;
     FileStreamDecoder streamObj(vidFname);
 
-    // get all the frames
-    cerr << " * decoding video stream" << endl;
-    Image<RGB_t> *cFrame;
-    vector<Image<RGB_t> *> frames;
-    do {
-      cFrame = streamObj.getFrame();
-      if (cFrame) {
-        frames.push_back(cFrame);
-      }
-    } while (cFrame);
-
-    // info
-    cerr << " * decoded " << frames.size() << " video frames" << endl;
-
     // compute 1-D gaussian convolution kernel
     int gaussSize;
     float *gaussKernel;
     makeGaussianKernel(sigma, &gaussKernel, gaussSize);
 
-    // vectors to store optical flow estimates
-    vector<Image<float> > dus;
-    vector<Image<float> > dvs;
+    // blurred brightness images of all the frames, each frame is released
+    // as soon as it is converted so the colour frames are never all held
+    cerr << " * decoding video stream" << endl;
+    Image<RGB_t> *cFrame;
+    vector<Image<float> > imgs;
+    while ((cFrame = streamObj.getFrame()) != 0) {
+      Image<float> *img = computeBrightness(cFrame);
+      delete cFrame;
+
+      img->convolve(gaussKernel, gaussSize);
+      imgs.push_back(move(*img));
+      delete img;
+    }
+
+    // release the guassian filter
+    delete[] gaussKernel;
 
     // info
-    cerr << " * computing optical flow vectors" << endl;
+    cerr << " * decoded " << imgs.size() << " video frames" << endl;
 
-    // initialize the brightness image
-    Image<float> *cImg = computeBrightness(frames[0]);
-    cImg->convolve(gaussKernel, gaussSize);
+    // vectors to store optical flow estimates
+    vector<FlowField> flows;
+    vector<TileMask_t> masks; // tiles that changed in each frame pair
+    vector<FlowStats_t> stats;
 
     // get reference dimensions
-    int height = cImg->height();
-    int width = cImg->width();
-
-    // loop over frames two at a time
-    unsigned frameNum = 1;
-    do {
-      // info
-      cerr << "   -- frame " << frameNum << endl;
-
-      // update the previous brightness pointer
-      Image<float> *pImg = cImg;
-
-      // update the current brightness pointer
-      cImg = computeBrightness(frames[frameNum]);
-      cImg->convolve(gaussKernel, gaussSize);
-
-      // compute the optical flow between these two frames
-      Image<float> u, v;
-      computeOpticalFlow_HLK(pImg, cImg, winSize, &u, &v);
-
-      // save optical flow estimates
-      dus.push_back(u);
-      dvs.push_back(v);
+    int height = imgs[0].height();
+    int width = imgs[0].width();
 
-      frameNum++;  // go to next frame
-      delete pImg; // release prior brightness image
-    } while (frameNum < frames.size());
+    // info
+    cerr << " * computing optical flow vectors" << endl;
 
-    // release final image
-    delete cImg;
+    // the frame pairs are solved concurrently and the pyramid of each frame
+    // is shared by its two pairs; with -gate only the tiles that changed
+    // between two frames are solved, with -adaptive each pair uses as many
+    // pyramid levels as its motion needs and with -textureskip textureless
+    // regions found at a coarse level are not solved again at finer levels
+    computeOpticalFlow_Batch(&imgs[0], imgs.size(), winSize, &flows, params,
+                             &masks, verbose ? &stats : 0);
+
+    if (verbose) {
+      for (unsigned i = 0; i < stats.size(); i++) {
+        // textureless pixels skipped at each level, finest first
+        cerr << "   -- frame " << i + 1 << " skipped";
+        for (unsigned l = 0; l < stats[i].skipped.size(); l++) {
+          cerr << " " << stats[i].skipped[l];
+        }
+        cerr << endl;
+      }
 
-    // release the guassian filter
-    delete[] gaussKernel;
+      // image buffers taken from the heap and reused so far
+      PoolStats_t ps = BufferPool::instance().stats();
+      cerr << "   -- image buffers " << ps.heapAllocs << " allocated "
+           << ps.reuses << " reused" << endl;
+    }
 
-    // release frames
-    for (unsigned i = 0; i < frames.size(); i++)
-      delete frames[i];
+    // release brightness images
+    imgs.clear();
 
     // info
     cerr << " * integrating frames in window size " << tsteps << endl;
 
     // coherenetly integrate up of the optical flow estimates over window
-    // and compute squared magnitude
+    // and compute squared magnitude, the flow of tiles that are static in
+    // every frame of the window is zero so they are skipped
     vector<Image<float> > sqmags;
-    for (unsigned i = 0; i < dus.size() - tsteps; i++) {
-      Image<float> usum(height, width), vsum(height, width);
-      for (unsigned j = 0; j < tsteps; j++) {
-        usum = usum + dus[i + j];
-        vsum = vsum + dvs[i + j];
+    vector<TileMask_t> sqmagTiles;
+    for (unsigned i = 0; i < flows.size() - tsteps; i++) {
+      TileMask_t tiles = masks[i];
+      for (unsigned j = 1; j < tsteps; j++) {
+        tiles.merge(masks[i + j]);
       }
 
-      usum = usum * (1.0 / tsteps);
-      vsum = vsum * (1.0 / tsteps);
+      Image<float> sqmag(height, width);
+      for (int h = 0; h < height; h++) {
+        for (int w = 0; w < width; w++) {
+          if (!tiles.isActive(h, w))
+            continue;
+
+          int ind = h * width + w;
+          float usum = 0.0, vsum = 0.0;
+          for (unsigned j = 0; j < tsteps; j++) {
+            usum += flows[i + j].u()[ind];
+            vsum += flows[i + j].v()[ind];
+          }
+
+          usum *= 1.0 / tsteps;
+          vsum *= 1.0 / tsteps;
+          sqmag[ind] = usum * usum + vsum * vsum;
+        }
+      }
 
-      sqmags.push_back(usum * usum + vsum * vsum);
+      sqmags.push_back(sqmag);
+      sqmagTiles.push_back(tiles);
     }
 
-    // initialize the edges for graph segmentation
-    vector<Edge_t> edgeVec(height * width * 4);
+    // edges for graph segmentation
+    vector<Edge_t> edgeVec;
+    edgeVec.reserve(height * width * 4);
 
     // initialize memory for segmented image
     Image<RGB_t> segImg(height, width);
@@ -142,8 +178,8 @@ int main(int argc, char **argv) {
 
     // loop over integrated images
     for (unsigned i = 0; i < sqmags.size(); i++) {
-      // create the complete graph
-      createGraph(&sqmags[i], edgeVec);
+      // create the graph, static tiles are one set
+      createGraph(&sqmags[i], &sqmagTiles[i], edgeVec);
 
       // segment graph
       DisjointSet<int> universe;
@@ -0,0 +1,394 @@
+#ifndef _SPARSE_FLOW_H_
+#define _SPARSE_FLOW_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "Image.h"
+#include "StructureTensor.h"
+#include "ThreadPool.h"
+#include "opticalFlow.h"
+
+using namespace std;
+
+// number of points handed to a thread at a time
+const int PARALLEL_POINTS = 64;
+
+/* Run time options for sparse KLT feature tracking. */
+struct KLTParams_t {
+  // Shi-Tomasi corner selection: most corners returned, minimum eigenvalue
+  // relative to the strongest corner, minimum distance between corners in
+  // pixels, the window over which the structure tensor is summed and the
+  // pyramid level whose pixels are searched (0 is full resolution, each
+  // level above it quarters the cost and places corners on a coarser grid)
+  int maxCorners;
+  float qualityLevel;
+  int minDistance;
+  int blockSize;
+  int cornerLevel;
+
+  // per point tracking: window size, pyramid levels, Newton iterations per
+  // level, update length at which to stop and the minimum eigenvalue of the
+  // window tensor (per pixel) below which a point is lost
+  int winSize;
+  int numLevels;
+  int numIters;
+  float epsilon;
+  float minEigThreshold;
+
+  KLTParams_t()
+      : maxCorners(2000), qualityLevel(0.01), minDistance(10), blockSize(3),
+        cornerLevel(1), winSize(15), numLevels(3), numIters(10), epsilon(0.01),
+        minEigThreshold(1e-2) {}
+};
+
+/* A feature point of pImg and its displacement (u, v) to cImg.  quality is
+   the minimum eigenvalue at selection, and tracked is false if the point was
+   lost or moved outside the image. */
+struct FeaturePoint_t {
+  float x, y;
+  float u, v;
+  float quality;
+  bool tracked;
+};
+
+/* Smaller eigenvalue of the structure tensor summed over a winSize x winSize
+   window about every pixel, from the derivatives dx and dy. */
+void computeMinEigenvalues(const Image<float> *dx, const Image<float> *dy,
+                           const int &winSize, Image<float> *eig) {
+  int height = dx->height();
+  int width = dx->width();
+
+  eig->init(height, width);
+
+  parallelFor(0, height, TENSOR_BAND_ROWS, [&](int h0, int h1) {
+    StructureTensor st(h1 - h0, width);
+
+    // the time channels are not used, so dx stands in for dt
+    st.accumulate(dx, dy, dx, winSize, h0, h1);
+
+    for (int h = h0; h < h1; h++) {
+      const float *t_dx_2 = st.row(h - h0, StructureTensor::DX_2);
+      const float *t_dy_2 = st.row(h - h0, StructureTensor::DY_2);
+      const float *t_dxy = st.row(h - h0, StructureTensor::DXY);
+
+      for (int w = 0; w < width; w++) {
+        float d = t_dx_2[w] * t_dy_2[w] - t_dxy[w] * t_dxy[w];
+        float tr = t_dx_2[w] + t_dy_2[w];
+        float desc = tr * tr / 4.0 - d;
+
+        eig->setPixel(h * width + w,
+                      tr / 2.0 - sqrt(max(desc, (float)0.0)));
+      }
+    }
+  });
+}
+
+/* Shi-Tomasi corner selection.  Pixels that are a 3x3 local maximum of the
+   minimum eigenvalue map and exceed qualityLevel of the strongest response
+   are taken strongest first, skipping any closer than minDistance to a
+   corner already taken, until maxCorners are found.  Pixels whose tracking
+   window does not fit in the image are not used, since the zero border of
+   the derivatives makes them look like corners.  eig may be the map of a
+   pyramid level scale times smaller than the image, the corners are then
+   returned in full resolution coordinates, on a grid scale pixels apart. */
+void selectCorners(const Image<float> *eig, const KLTParams_t &params,
+                   vector<FeaturePoint_t> *points, const int scale = 1) {
+  int height = eig->height();
+  int width = eig->width();
+  float maxEig = 0.0;
+
+  points->clear();
+
+  for (int i = 0; i < height * width; i++) {
+    maxEig = max(maxEig, eig->getPixel(i));
+  }
+  if (maxEig <= 0.0)
+    return;
+
+  float thresh = params.qualityLevel * maxEig;
+
+  // candidate local maxima away from the image border
+  int margin =
+      max((params.winSize / 2 + scale - 1) / scale, params.blockSize) + 1;
+  vector<pair<float, int> > cand;
+  for (int h = margin; h < height - margin; h++) {
+    for (int w = margin; w < width - margin; w++) {
+      int ind = h * width + w;
+      float e = eig->getPixel(ind);
+      if (e < thresh)
+        continue;
+
+      bool isMax = true;
+      for (int i = -1; i <= 1 && isMax; i++) {
+        for (int j = -1; j <= 1; j++) {
+          if (eig->getPixel(ind + i * width + j) > e) {
+            isMax = false;
+            break;
+          }
+        }
+      }
+
+      if (isMax)
+        cand.push_back(make_pair(-e, ind));
+    }
+  }
+
+  // strongest first, ties in raster order
+  sort(cand.begin(), cand.end());
+
+  // grid of cells minDistance wide holding the corners taken so far
+  int minDist = params.minDistance / scale;
+  int cell = max(minDist, 1);
+  int gh = (height + cell - 1) / cell;
+  int gw = (width + cell - 1) / cell;
+  vector<vector<int> > grid(gh * gw);
+  int d2 = minDist * minDist;
+
+  for (unsigned k = 0; k < cand.size(); k++) {
+    if ((int)points->size() >= params.maxCorners)
+      break;
+
+    int h = cand[k].second / width;
+    int w = cand[k].second % width;
+    int gy = h / cell;
+    int gx = w / cell;
+
+    // check the neighbouring cells for a corner that is too close
+    bool isFree = true;
+    for (int i = max(gy - 1, 0); i <= min(gy + 1, gh - 1) && isFree; i++) {
+      for (int j = max(gx - 1, 0); j <= min(gx + 1, gw - 1) && isFree; j++) {
+        const vector<int> &c = grid[i * gw + j];
+        for (unsigned n = 0; n < c.size(); n++) {
+          int dh = c[n] / width - h;
+          int dw = c[n] % width - w;
+          if (dh * dh + dw * dw < d2) {
+            isFree = false;
+            break;
+          }
+        }
+      }
+    }
+
+    if (!isFree)
+      continue;
+
+    grid[gy * gw + gx].push_back(cand[k].second);
+
+    FeaturePoint_t p;
+    p.x = w * scale;
+    p.y = h * scale;
+    p.u = p.v = 0.0;
+    p.quality = -cand[k].first;
+    p.tracked = false;
+    points->push_back(p);
+  }
+}
+
+/* Bilinear samples of img over the n x n window whose first sample is at
+   (y, x), in raster order.  All samples of the window share one fractional
+   offset, so a window inside the image is interpolated from row pointers
+   with a single set of weights, and only windows crossing the border are
+   sampled one at a time with sampleClamped(). */
+void sampleWindow(const Image<float> *img, const float y, const float x,
+                  const int n, float *win) {
+  float fy = floor(y), fx = floor(x);
+
+  // compared as floats so a diverged position is never converted to int
+  if (!(fy >= 0.0f && fx >= 0.0f && fy + n < img->height() &&
+        fx + n < img->width())) {
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < n; j++) {
+        win[i * n + j] = sampleClamped(img, y + i, x + j);
+      }
+    }
+    return;
+  }
+
+  int iy = (int)fy, ix = (int)fx;
+  float a = x - fx, b = y - fy;
+  int width = img->width();
+  for (int i = 0; i < n; i++) {
+    const float *r0 = &(*img)[(iy + i) * width + ix];
+    const float *r1 = r0 + width;
+    for (int j = 0; j < n; j++) {
+      float t0 = (1.0f - a) * r0[j] + a * r0[j + 1];
+      float t1 = (1.0f - a) * r1[j] + a * r1[j + 1];
+      win[i * n + j] = (1.0f - b) * t0 + b * t1;
+    }
+  }
+}
+
+/* Track one point from pImg to cImg with pyramidal Lucas and Kanade, where
+   the window of pImg about the point is matched against cImg sampled
+   (bilinear) at the displaced window and the displacement is refined by
+   Newton iterations at every level from coarse to fine. */
+void trackPoint(const FramePyramid_t *pp, const FramePyramid_t *cp,
+                const KLTParams_t &params, FeaturePoint_t *pt) {
+  int numLevels = pp->levels.size();
+  int r = params.winSize / 2;
+  int n = 2 * r + 1;
+  float gu = 0.0, gv = 0.0; // displacement estimate at the current level
+
+  // window samples of pImg and its gradients, the pImg window with a one
+  // pixel border for the central differences and the displaced cImg window
+  vector<float> pI(n * n), pIx(n * n), pIy(n * n);
+  vector<float> pWin((n + 2) * (n + 2)), cWin(n * n);
+
+  pt->tracked = true;
+
+  for (int l = numLevels - 1; l >= 0; l--) {
+    const Image<float> *pl = &pp->levels[l];
+    const Image<float> *cl = &cp->levels[l];
+    float scale = 1.0 / (1 << l);
+    float y = pt->y * scale;
+    float x = pt->x * scale;
+
+    // spatial gradient matrix of the pImg window
+    sampleWindow(pl, y - r - 1, x - r - 1, n + 2, &pWin[0]);
+    double g11 = 0.0, g12 = 0.0, g22 = 0.0;
+    for (int i = 0; i < n; i++) {
+      const float *w0 = &pWin[i * (n + 2) + 1];
+      const float *w1 = w0 + (n + 2);
+      const float *w2 = w1 + (n + 2);
+
+      for (int j = 0; j < n; j++) {
+        int k = i * n + j;
+        float ix = (w1[j + 1] - w1[j - 1]) * 0.5;
+        float iy = (w2[j] - w0[j]) * 0.5;
+
+        pI[k] = w1[j];
+        pIx[k] = ix;
+        pIy[k] = iy;
+        g11 += ix * ix;
+        g12 += ix * iy;
+        g22 += iy * iy;
+      }
+    }
+
+    // lose points whose window has too little texture
+    double d = g11 * g22 - g12 * g12;
+    double tr = g11 + g22;
+    double minEig = tr / 2.0 - sqrt(max(tr * tr / 4.0 - d, 0.0));
+    if (minEig / (n * n) < params.minEigThreshold || d == 0.0) {
+      pt->tracked = false;
+      break;
+    }
+
+    // newton iterations on the residual of the displaced window
+    for (int it = 0; it < params.numIters; it++) {
+      double b1 = 0.0, b2 = 0.0;
+      sampleWindow(cl, y + gv - r, x + gu - r, n, &cWin[0]);
+      for (int k = 0; k < n * n; k++) {
+        float e = pI[k] - cWin[k];
+        b1 += e * pIx[k];
+        b2 += e * pIy[k];
+      }
+
+      float du = (g22 * b1 - g12 * b2) / d;
+      float dv = (g11 * b2 - g12 * b1) / d;
+      gu += du;
+      gv += dv;
+
+      if (du * du + dv * dv < params.epsilon * params.epsilon)
+        break;
+    }
+
+    // guess for the next finer level
+    if (l > 0) {
+      gu *= 2.0;
+      gv *= 2.0;
+    }
+  }
+
+  pt->u = gu;
+  pt->v = gv;
+
+  // lose points that moved outside the image
+  float xc = pt->x + gu;
+  float yc = pt->y + gv;
+  if (xc < 0 || yc < 0 || xc > pp->levels[0].width() - 1 ||
+      yc > pp->levels[0].height() - 1) {
+    pt->tracked = false;
+  }
+}
+
+/* Track the points of pImg to cImg using the pyramids of both frames.  Only
+   the x and y of each point are read; u, v and tracked are set. */
+void trackPoints_KLT(const FramePyramid_t *pp, const FramePyramid_t *cp,
+                     const KLTParams_t &params,
+                     vector<FeaturePoint_t> *points) {
+  parallelFor(0, points->size(), PARALLEL_POINTS, [&](int i0, int i1) {
+    for (int i = i0; i < i1; i++) {
+      trackPoint(pp, cp, params, &(*points)[i]);
+    }
+  });
+}
+
+/* Move the tracked points to where they were tracked to and drop the lost
+   ones, so the points of one frame pair are the points of the next. */
+void advancePoints_KLT(vector<FeaturePoint_t> *points) {
+  unsigned n = 0;
+  for (unsigned i = 0; i < points->size(); i++) {
+    FeaturePoint_t p = (*points)[i];
+    if (!p.tracked)
+      continue;
+
+    p.x += p.u;
+    p.y += p.v;
+    p.u = p.v = 0.0;
+    (*points)[n++] = p;
+  }
+  points->resize(n);
+}
+
+/* Select the Shi-Tomasi corners of the frame with pyramid pp, searching the
+   pixels of pyramid level params.cornerLevel (or the coarsest level built)
+   so the derivatives and eigenvalue map cover only a fraction of the frame
+   at the finer corner grid's expense. */
+void selectCorners_KLT(const FramePyramid_t *pp, const KLTParams_t &params,
+                       vector<FeaturePoint_t> *points) {
+  int level = min(max(params.cornerLevel, 0), (int)pp->levels.size() - 1);
+  ImageDerivatives_t pd;
+  Image<float> eig;
+
+  computeDerivatives(&pp->levels[level], kt_22, &pd.dx, &pd.dy, &pd.dt);
+  computeMinEigenvalues(&pd.dx, &pd.dy, params.blockSize, &eig);
+  selectCorners(&eig, params, points, 1 << level);
+}
+
+/* Build the gaussian pyramid KLT tracks on, the levels only, since the
+   derivatives are sampled about each point. */
+void buildPyramid_KLT(const Image<float> *img, const KLTParams_t &params,
+                      FramePyramid_t *py) {
+  img->pyramid(params.numLevels, py->levels);
+}
+
+/* Sparse optical flow between two frames whose pyramids are already built:
+   select the Shi-Tomasi corners of the first and track them to the second
+   with pyramidal Lucas and Kanade.  Through a sequence of frames the
+   pyramid of each frame is built once and used for two pairs, see
+   KLTStream. */
+void computeSparseFlow_KLT(const FramePyramid_t *pp, const FramePyramid_t *cp,
+                           vector<FeaturePoint_t> *points,
+                           const KLTParams_t &params = KLTParams_t()) {
+  selectCorners_KLT(pp, params, points);
+  trackPoints_KLT(pp, cp, params, points);
+}
+
+/* Sparse optical flow: select Shi-Tomasi corners of pImg and track them to
+   cImg with pyramidal Lucas and Kanade.  Only the pyramids are built for the
+   whole frame, the corners are searched on a coarser pyramid level and the
+   tracking samples a window about each point. */
+void computeSparseFlow_KLT(const Image<float> *pImg, const Image<float> *cImg,
+                           vector<FeaturePoint_t> *points,
+                           const KLTParams_t &params = KLTParams_t()) {
+  FramePyramid_t pyramid_1, pyramid_2;
+
+  buildPyramid_KLT(pImg, params, &pyramid_1);
+  buildPyramid_KLT(cImg, params, &pyramid_2);
+
+  computeSparseFlow_KLT(&pyramid_1, &pyramid_2, points, params);
+}
+
+#endif // _SPARSE_FLOW_H_
@@ -0,0 +1,47 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+using namespace std;
+
+#include "allocCounter.h"
+
+/* Replacement global allocation functions that count every allocation.
+   They live in their own translation unit so the compiler cannot inline
+   one half of a new/delete pair into its callers. */
+
+// heap allocations made through operator new
+static atomic<long> numAllocs(0);
+
+long allocationCount() { return (numAllocs.load()); }
+
+void *operator new(size_t n) {
+  numAllocs++;
+  void *p = malloc(n ? n : 1);
+  if (!p)
+    throw bad_alloc();
+  return (p);
+}
+
+void *operator new[](size_t n) { return (operator new(n)); }
+
+void *operator new(size_t n, const nothrow_t &) noexcept {
+  numAllocs++;
+  return (malloc(n ? n : 1));
+}
+
+void *operator new[](size_t n, const nothrow_t &) noexcept {
+  return (operator new(n, nothrow));
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete[](void *p) noexcept { free(p); }
+
+void operator delete(void *p, const nothrow_t &) noexcept { free(p); }
+
+void operator delete[](void *p, const nothrow_t &) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+void operator delete[](void *p, size_t) noexcept { free(p); }
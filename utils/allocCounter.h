@@ -0,0 +1,9 @@
+#ifndef _ALLOC_COUNTER_H_
+#define _ALLOC_COUNTER_H_
+
+/* Number of heap allocations made through operator new, by every thread,
+   since the program started.  Link allocCounter.cpp to replace the global
+   allocation functions with counting ones. */
+long allocationCount();
+
+#endif // _ALLOC_COUNTER_H_
@@ -0,0 +1,628 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+using namespace std;
+
+#include "BufferPool.h"
+#include "allocCounter.h"
+#include "Exception.h"
+#include "FlowField.h"
+#include "FlowStream.h"
+#include "KLTStream.h"
+#include "flowBatch.h"
+#include "Image.h"
+#include "hornSchunck.h"
+#include "opticalFlow.h"
+#include "sparseFlow.h"
+
+/* Wall clock time in seconds. */
+double getTime() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+/* Fill an image with uniform random values in [0, 255). */
+void randomImage(const int height, const int width, Image<float> *img) {
+  img->init(height, width);
+  for (int i = 0; i < height * width; i++) {
+    img->setPixel(i, (rand() % 25500) / 100.0);
+  }
+}
+
+/* Compare the windowed structure tensor sums of StructureTensor::accumulate
+   against convolving each of the five tensor products with a kernel of all
+   ones, for a range of window sizes. */
+void benchBoxFilter(const int height, const int width) {
+  Image<float> dx, dy, dt;
+  randomImage(height, width, &dx);
+  randomImage(height, width, &dy);
+  randomImage(height, width, &dt);
+
+  // tensor products in the channel order of StructureTensor
+  vector<Image<float> > prods(StructureTensor::NUM_CHANNELS);
+  for (unsigned c = 0; c < prods.size(); c++) {
+    prods[c].init(height, width);
+  }
+  for (int i = 0; i < height * width; i++) {
+    prods[StructureTensor::DX_2][i] = dx[i] * dx[i];
+    prods[StructureTensor::DY_2][i] = dy[i] * dy[i];
+    prods[StructureTensor::DXY][i] = dx[i] * dy[i];
+    prods[StructureTensor::DXT][i] = dx[i] * dt[i];
+    prods[StructureTensor::DYT][i] = dy[i] * dt[i];
+  }
+
+  StructureTensor st(height, width);
+
+  cout << "winSize  convolve(s)  accumulate(s)  speedup  maxRelErr" << endl;
+  for (int winSize = 3; winSize <= 31; winSize += 2) {
+    vector<float> k(winSize * winSize, 1.0);
+
+    vector<Image<float> > sums = prods;
+    double t0 = getTime();
+    for (unsigned c = 0; c < sums.size(); c++) {
+      sums[c].convolve(&k[0], winSize, winSize);
+    }
+    double t1 = getTime();
+
+    double t2 = getTime();
+    st.accumulate(&dx, &dy, &dt, winSize, 0, height);
+    double t3 = getTime();
+
+    float maxErr = 0.0;
+    for (unsigned c = 0; c < sums.size(); c++) {
+      for (int h = 0; h < height; h++) {
+        const float *a = &sums[c][h * width];
+        const float *b = st.row(h, c);
+        for (int w = 0; w < width; w++) {
+          float e = fabs(a[w] - b[w]) / (fabs(a[w]) + 1.0);
+          if (e > maxErr)
+            maxErr = e;
+        }
+      }
+    }
+
+    cout << winSize << "\t " << (t1 - t0) << "\t      " << (t3 - t2)
+         << "\t    " << (t1 - t0) / (t3 - t2) << "\t     " << maxErr << endl;
+  }
+}
+
+/* Time the displaced-window tensor accumulation used by the refinement
+   levels of hierarchical LK and count the heap allocations it makes. */
+void benchWarpedTensor(const int height, const int width) {
+  ImageDerivatives_t pd, cd;
+  Image<float> u0, v0;
+  randomImage(height, width, &pd.dx);
+  randomImage(height, width, &pd.dy);
+  randomImage(height, width, &pd.dt);
+  randomImage(height, width, &cd.dx);
+  randomImage(height, width, &cd.dy);
+  randomImage(height, width, &cd.dt);
+
+  // smooth displacement field of a few pixels
+  u0.init(height, width);
+  v0.init(height, width);
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      u0[h * width + w] = 3.0 * sin(h * 0.01);
+      v0[h * width + w] = 2.0 * cos(w * 0.01);
+    }
+  }
+
+  StructureTensor st(height, width);
+
+  cout << "winSize  time(s)  allocs/frame" << endl;
+  for (int winSize = 3; winSize <= 15; winSize += 2) {
+    long allocs = allocationCount();
+    double t0 = getTime();
+    accumulateWarpedTensor(&pd, &cd, &u0, &v0, winSize, 0, height, &st);
+    double t1 = getTime();
+    allocs = allocationCount() - allocs;
+
+    cout << winSize << "\t " << (t1 - t0) << "\t  " << allocs << endl;
+  }
+}
+
+/* Compare dense hierarchical LK against sparse KLT tracking on a pair of
+   frames where the second is the first shifted by (2, 1) pixels, and report
+   the mean end point error of the tracked points.  Then track through a
+   sequence of such frames, once pair by pair and once with a KLTStream
+   that builds each pyramid once and carries the points on. */
+void benchSparseFlow(const int height, const int width) {
+  Image<float> pImg, cImg(height, width);
+  randomImage(height, width, &pImg);
+
+  // smooth the noise so it can be tracked
+  float k[] = {0.25, 0.5, 0.25};
+  pImg.convolve(k, 3);
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int hp = max(h - 1, 0);
+      int wp = max(w - 2, 0);
+      cImg[h * width + w] = pImg[hp * width + wp];
+    }
+  }
+
+  FlowField flow;
+  double t0 = getTime();
+  computeOpticalFlow_HLK(&pImg, &cImg, 7, &flow);
+  double t1 = getTime();
+
+  vector<FeaturePoint_t> points;
+  double t2 = getTime();
+  computeSparseFlow_KLT(&pImg, &cImg, &points);
+  double t3 = getTime();
+
+  // mean end point error of the tracked points against the known shift
+  int tracked = 0;
+  double err = 0.0;
+  for (unsigned i = 0; i < points.size(); i++) {
+    if (!points[i].tracked)
+      continue;
+
+    float du = points[i].u - 2.0;
+    float dv = points[i].v - 1.0;
+    err += sqrt(du * du + dv * dv);
+    tracked++;
+  }
+
+  cout << "dense HLK(s)  sparse KLT(s)  speedup  points  tracked  endPointErr"
+       << endl;
+  cout << (t1 - t0) << "\t      " << (t3 - t2) << "\t     "
+       << (t1 - t0) / (t3 - t2) << "\t      " << points.size() << "\t  "
+       << tracked << "\t   " << (tracked ? err / tracked : 0.0) << endl;
+
+  // sequence of frames each shifted by (2, 1) from the one before
+  const int numFrames = 8;
+  vector<Image<float> > frames(numFrames);
+  frames[0] = pImg;
+  for (int f = 1; f < numFrames; f++) {
+    frames[f].init(height, width);
+    for (int h = 0; h < height; h++) {
+      for (int w = 0; w < width; w++) {
+        int hp = max(h - 1, 0);
+        int wp = max(w - 2, 0);
+        frames[f][h * width + w] = frames[f - 1][hp * width + wp];
+      }
+    }
+  }
+
+  double t4 = getTime();
+  for (int f = 1; f < numFrames; f++) {
+    computeSparseFlow_KLT(&frames[f - 1], &frames[f], &points);
+  }
+  double t5 = getTime();
+
+  // corners of the first frame carried through the whole sequence
+  KLTStream stream;
+  points.clear();
+  double t6 = getTime();
+  for (int f = 0; f < numFrames; f++) {
+    if (f > 1)
+      advancePoints_KLT(&points);
+    stream.addFrame(&frames[f], &points);
+  }
+  double t7 = getTime();
+
+  tracked = 0;
+  for (unsigned i = 0; i < points.size(); i++) {
+    tracked += points[i].tracked;
+  }
+
+  cout << "pairs  pairwise KLT(s)  KLTStream(s)  speedup  tracked" << endl;
+  cout << numFrames - 1 << "\t" << (t5 - t4) << "\t\t " << (t7 - t6)
+       << "\t       " << (t5 - t4) / (t7 - t6) << "\t" << tracked << endl;
+}
+
+/* Time dense inverse search at each speed and quality setting against
+   hierarchical LK on a pair of frames with a known (2.6, 1.3) shift, and
+   report the mean end point error of each. */
+void benchDIS(const int height, const int width) {
+  Image<float> pImg(height, width), cImg(height, width);
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      pImg[h * width + w] = 100.0 + 50.0 * sin(w * 0.13 + h * 0.05) +
+                            40.0 * cos(h * 0.11 - w * 0.07);
+      cImg[h * width + w] = 100.0 + 50.0 * sin((w - 2.6) * 0.13 +
+                                               (h - 1.3) * 0.05) +
+                            40.0 * cos((h - 1.3) * 0.11 - (w - 2.6) * 0.07);
+    }
+  }
+
+  cout << "method  time(s)  endPointErr" << endl;
+  for (int q = -1; q <= DIS_HIGH; q++) {
+    FlowField flow;
+    double t0 = getTime();
+    if (q < 0) {
+      computeOpticalFlow_HLK(&pImg, &cImg, 7, &flow);
+    } else {
+      FlowParams_t params;
+      setDISQuality(q, &params);
+      computeOpticalFlow_DIS(&pImg, &cImg, &flow, params);
+    }
+    double t1 = getTime();
+
+    double err = 0.0;
+    for (int i = 0; i < height * width; i++) {
+      Vec2f_t f = flow[i];
+      err += sqrt((f[0] - 2.6) * (f[0] - 2.6) + (f[1] - 1.3) * (f[1] - 1.3));
+    }
+
+    if (q < 0)
+      cout << "HLK";
+    else
+      cout << "DIS " << q;
+    cout << "\t" << (t1 - t0) << "\t " << err / (height * width) << endl;
+  }
+}
+
+/* Time tiled hierarchical LK for a range of memory budgets against the
+   whole frame version and report the largest difference in the flow. */
+void benchTiledHLK(const int height, const int width) {
+  Image<float> pImg, cImg(height, width);
+  randomImage(height, width, &pImg);
+
+  // smooth the noise and shift it by (2, 1) pixels
+  float k[] = {0.25, 0.5, 0.25};
+  pImg.convolve(k, 3);
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      cImg[h * width + w] = pImg[max(h - 1, 0) * width + max(w - 2, 0)];
+    }
+  }
+
+  FlowField flow;
+  double t0 = getTime();
+  computeOpticalFlow_HLK(&pImg, &cImg, 7, &flow);
+  double t1 = getTime();
+
+  cout << "budget(MB)  time(s)  maxDiff" << endl;
+  cout << "whole\t    " << (t1 - t0) << "\t     0" << endl;
+  for (int mb = 8; mb <= 128; mb *= 2) {
+    FlowParams_t params;
+    params.tileMemoryBudget = (long)mb << 20;
+
+    FlowField tiled;
+    double t2 = getTime();
+    computeOpticalFlow_HLKTiled(&pImg, &cImg, 7, &tiled, params);
+    double t3 = getTime();
+
+    float maxDiff = 0.0;
+    for (int i = 0; i < height * width; i++) {
+      maxDiff = max(maxDiff, fabs(tiled.u()[i] - flow.u()[i]) +
+                                 fabs(tiled.v()[i] - flow.v()[i]));
+    }
+
+    cout << mb << "\t    " << (t3 - t2) << "\t     " << maxDiff << endl;
+  }
+}
+
+/* Time bidirectional hierarchical LK with the consistency check against
+   one direction on a pair of frames where a square moves (4, 0) pixels over
+   a static background, and count the occluded pixels. */
+void benchBidirectional(const int height, const int width) {
+  Image<float> pImg(height, width), cImg(height, width);
+  int h0 = height / 3, h1 = 2 * height / 3;
+  int w0 = width / 3, w1 = 2 * width / 3;
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      float b = 100.0 + 50.0 * sin(w * 0.13 + h * 0.05) +
+                40.0 * cos(h * 0.11 - w * 0.07);
+      float f = 120.0 + 60.0 * cos(w * 0.19 - h * 0.08) +
+                50.0 * sin(h * 0.29 + w * 0.05);
+      float fs = 120.0 + 60.0 * cos((w - 4) * 0.19 - h * 0.08) +
+                 50.0 * sin(h * 0.29 + (w - 4) * 0.05);
+      bool inP = h >= h0 && h < h1 && w >= w0 && w < w1;
+      bool inC = h >= h0 && h < h1 && w >= w0 + 4 && w < w1 + 4;
+      pImg[h * width + w] = inP ? f : b;
+      cImg[h * width + w] = inC ? fs : b;
+    }
+  }
+
+  FlowField flow;
+  double t0 = getTime();
+  computeOpticalFlow_HLK(&pImg, &cImg, 7, &flow);
+  double t1 = getTime();
+
+  FlowField fwd, bwd;
+  Image<float> conf;
+  Image<unsigned char> occ;
+  double t2 = getTime();
+  computeOpticalFlow_BiHLK(&pImg, &cImg, 7, &fwd, &bwd, &occ, &conf);
+  double t3 = getTime();
+
+  long occluded = 0;
+  for (int i = 0; i < height * width; i++) {
+    occluded += occ[i];
+  }
+
+  cout << "forward(s)  bidirectional(s)  ratio  occluded" << endl;
+  cout << (t1 - t0) << "\t    " << (t3 - t2) << "\t      "
+       << (t3 - t2) / (t1 - t0) << "\t     " << occluded << endl;
+}
+
+/* Run a flow stream over frames of a texture panning (2, 1) pixels per
+   frame and report the heap allocations made for each frame, both the
+   image buffers taken from the heap by the buffer pool and every other
+   operator new.  After the first frames every image buffer should come
+   from the pool and no other memory should be allocated.  The same frames
+   are then solved as a batch a few times with a kept BatchScratch_t and
+   output, where every batch after the first should allocate nothing. */
+void benchStream(const int height, const int width) {
+  const int numFrames = 8;
+  Image<float> noise, frame(height + 2 * numFrames, width + 2 * numFrames);
+  randomImage(height + 2 * numFrames, width + 2 * numFrames, &noise);
+
+  float k[] = {0.25, 0.5, 0.25};
+  noise.convolve(k, 3);
+
+  FlowParams_t params;
+  params.motionGate = true;
+  params.warmStart = true;
+  FlowStream stream(7, params);
+  FlowField flow;
+  vector<Image<float> > frames;
+
+  cout << "frame  time(s)  poolAllocs  poolReuses  otherAllocs" << endl;
+  for (int f = 0; f < numFrames; f++) {
+    frame.init(height, width);
+    for (int h = 0; h < height; h++) {
+      for (int w = 0; w < width; w++) {
+        frame[h * width + w] = noise[(h + f) * noise.width() + w + 2 * f];
+      }
+    }
+
+    BufferPool::instance().resetCounters();
+    long allocs = allocationCount();
+    double t0 = getTime();
+    stream.addFrame(&frame, &flow);
+    double t1 = getTime();
+    allocs = allocationCount() - allocs;
+    PoolStats_t ps = BufferPool::instance().stats();
+
+    cout << f << "\t" << (t1 - t0) << "\t " << ps.heapAllocs << "\t     "
+         << ps.reuses << "\t " << allocs << endl;
+
+    frames.push_back(frame);
+  }
+
+  vector<FlowField> flows;
+  vector<TileMask_t> tiles;
+  BatchScratch_t work;
+
+  cout << "batch  time(s)  poolAllocs  poolReuses  otherAllocs" << endl;
+  for (int b = 0; b < 4; b++) {
+    BufferPool::instance().resetCounters();
+    long allocs = allocationCount();
+    double t0 = getTime();
+    computeOpticalFlow_Batch(&frames[0], frames.size(), 7, &flows, params,
+                             &tiles, 0, &work);
+    double t1 = getTime();
+    allocs = allocationCount() - allocs;
+    PoolStats_t ps = BufferPool::instance().stats();
+
+    cout << b << "\t" << (t1 - t0) << "\t " << ps.heapAllocs << "\t     "
+         << ps.reuses << "\t " << allocs << endl;
+  }
+}
+
+/* Mean flow of the pixels at least border pixels from the image edge. */
+Vec2f_t meanFlow(const FlowField *flow, const int border) {
+  int height = flow->height();
+  int width = flow->width();
+  double su = 0.0, sv = 0.0;
+  int n = 0;
+
+  for (int h = border; h < height - border; h++) {
+    for (int w = border; w < width - border; w++) {
+      su += flow->u()[h * width + w];
+      sv += flow->v()[h * width + w];
+      n++;
+    }
+  }
+
+  Vec2f_t m;
+  m[0] = su / max(n, 1);
+  m[1] = sv / max(n, 1);
+  return (m);
+}
+
+/* Check that every flow engine reports a pan of smooth noise by
+   (+0.6, +0.3) pixels with the sign documented on FlowField, within half
+   the shift.  Throws if an engine does not. */
+void checkFlowSign(const int height, const int width) {
+  const float su = 0.6, sv = 0.3;
+  Image<float> pImg, cImg(height, width);
+  randomImage(height, width, &pImg);
+
+  // smooth noise, which has corners for KLT, sampled at the shift
+  float k[] = {0.0625, 0.25, 0.375, 0.25, 0.0625};
+  pImg.convolve(k, 5);
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      cImg[h * width + w] = pImg.bilinear(max(h - sv, (float)0.0),
+                                          max(w - su, (float)0.0));
+    }
+  }
+
+  const char *names[] = {"HS", "HSSOR", "LK", "HLK", "DIS", "KLT"};
+  bool ok = true;
+
+  cout << "engine  u       v" << endl;
+  for (int e = 0; e < 6; e++) {
+    FlowField flow, work;
+    FlowParams_t params;
+    Vec2f_t m;
+
+    if (e == 0) {
+      params.numIters = 200;
+      computeOpticalFlow_HS(&pImg, &cImg, 10.0, &work, &flow, params);
+    } else if (e == 1) {
+      computeOpticalFlow_HSSOR(&pImg, &cImg, 10.0, &flow);
+    } else if (e == 2) {
+      computeOpticalFlow_LK(&pImg, &cImg, 0, 7, &flow);
+    } else if (e == 3) {
+      computeOpticalFlow_HLK(&pImg, &cImg, 7, &flow);
+    } else if (e == 4) {
+      computeOpticalFlow_DIS(&pImg, &cImg, &flow, params);
+    }
+
+    if (e < 5) {
+      m = meanFlow(&flow, 16);
+    } else {
+      // mean displacement of the tracked points
+      vector<FeaturePoint_t> points;
+      computeSparseFlow_KLT(&pImg, &cImg, &points);
+
+      int n = 0;
+      m[0] = m[1] = 0.0;
+      for (unsigned i = 0; i < points.size(); i++) {
+        if (points[i].tracked) {
+          m[0] += points[i].u;
+          m[1] += points[i].v;
+          n++;
+        }
+      }
+      m[0] /= max(n, 1);
+      m[1] /= max(n, 1);
+    }
+
+    bool good = fabs(m[0] - su) < su / 2.0 && fabs(m[1] - sv) < sv / 2.0;
+    ok = ok && good;
+
+    cout << names[e] << "\t" << m[0] << "\t" << m[1]
+         << (good ? "" : "\t<- wrong") << endl;
+  }
+
+  if (!ok)
+    throw Exception("flow engines disagree on the sign of the flow");
+}
+
+/* The separable convolution as it was before the cache-blocked version: the
+   x pass is written transposed and the y pass transposes it back. */
+void convolveTransposed(Image<float> *img, const float *k, const int ksize) {
+  int height = img->height();
+  int width = img->width();
+  Image<float> temp(width, height);
+  int center = ksize >> 1;
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      float d = 0.0;
+      for (int c = -center; c <= center; c++) {
+        int wp = w + c;
+        if (wp >= 0 && wp < width)
+          d += (*img)[h * width + wp] * k[center + c];
+      }
+      temp[w * height + h] = d;
+    }
+  }
+
+  for (int h = 0; h < width; h++) {
+    for (int w = 0; w < height; w++) {
+      float d = 0.0;
+      for (int c = -center; c <= center; c++) {
+        int wp = w + c;
+        if (wp >= 0 && wp < height)
+          d += temp[h * height + wp] * k[center + c];
+      }
+      (*img)[w * width + h] = d;
+    }
+  }
+}
+
+/* Compare the transposing separable convolution against the cache-blocked
+   convolve() for odd kernel sizes from 3 to 15.  Both are timed on one
+   thread and the results must be identical. */
+void benchConvolve(const int height, const int width) {
+  Image<float> img;
+  randomImage(height, width, &img);
+
+  int threads = ThreadPool::instance().numThreads();
+  ThreadPool::instance().setNumThreads(1);
+
+  cout << "ksize  transposed(s)  blocked(s)  speedup  identical" << endl;
+  for (int ksize = 3; ksize <= 15; ksize += 2) {
+    vector<float> k(ksize);
+    for (int i = 0; i < ksize; i++) {
+      k[i] = 1.0 / (1.0 + abs(i - ksize / 2));
+    }
+
+    Image<float> a = img;
+    double t0 = getTime();
+    convolveTransposed(&a, &k[0], ksize);
+    double t1 = getTime();
+
+    Image<float> b = img;
+    double t2 = getTime();
+    b.convolve(&k[0], ksize);
+    double t3 = getTime();
+
+    bool same = true;
+    for (int i = 0; i < height * width; i++) {
+      same = same && (a[i] == b[i]);
+    }
+
+    cout << ksize << "\t" << (t1 - t0) << "\t       " << (t3 - t2) << "\t    "
+         << (t1 - t0) / (t3 - t2) << "\t     " << (same ? "yes" : "no")
+         << endl;
+  }
+
+  ThreadPool::instance().setNumThreads(threads);
+}
+
+int main(int argc, char **argv) {
+  string mode;
+  int height = 1080;
+  int width = 1920;
+
+  if (argc != 2 && argc != 4) {
+    cerr << argv[0] << " <box|conv|warp|klt|dis|tiled|bidir|stream|sign>"
+         << " [<height> <width>]" << endl;
+    return (1);
+  }
+
+  mode = argv[1];
+  if (argc == 4) {
+    height = atoi(argv[2]);
+    width = atoi(argv[3]);
+  }
+
+  try {
+    if (mode == "box") {
+      benchBoxFilter(height, width);
+    } else if (mode == "conv") {
+      benchConvolve(height, width);
+    } else if (mode == "warp") {
+      benchWarpedTensor(height, width);
+    } else if (mode == "klt") {
+      benchSparseFlow(height, width);
+    } else if (mode == "dis") {
+      benchDIS(height, width);
+    } else if (mode == "tiled") {
+      benchTiledHLK(height, width);
+    } else if (mode == "bidir") {
+      benchBidirectional(height, width);
+    } else if (mode == "stream") {
+      benchStream(height, width);
+    } else if (mode == "sign") {
+      checkFlowSign(height, width);
+    } else {
+      throw Exception("unknown benchmark mode");
+    }
+  } catch (Exception &e) {
+    cerr << "Error: " << e.what() << endl;
+    return (1);
+  } catch (...) {
+    cerr << "Error: caught unhandled exception" << endl;
+    return (1);
+  }
+
+  return (0);
+}
@@ -7,12 +7,13 @@ using namespace std;
 
 #include "Exception.h"
 #include "FileStreamDecoder.h"
+#include "FlowField.h"
 #include "Image.h"
 #include "gaussian.h"
 #include "opticalFlow.h"
 
 int main(int argc, char **argv) {
-  Image<float> u, v;
+  FlowField oflow;
   Image<float> pImg, cImg;
   Image<RGB_t> img1, img2;
   int winSize;
@@ -68,16 +69,7 @@ int main(int argc, char **argv) {
     cerr << " * computing optical flow vectors" << endl;
 
     // compute the optical flow between these two frames
-    computeOpticalFlow_HLK(&pImg, &cImg, winSize, &u, &v);
-
-    // create vector field for output format
-    Image<Vec2f_t> oflow(u.height(), u.width());
-    Vec2f_t vp;
-    for (int i = 0; i < u.height() * u.width(); i++) {
-      vp[0] = u[i];
-      vp[1] = v[i];
-      oflow[i] = vp;
-    }
+    computeOpticalFlow_HLK(&pImg, &cImg, winSize, &oflow);
 
     // output the optical flow vectors
     {